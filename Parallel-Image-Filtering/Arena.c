@@ -0,0 +1,184 @@
+/**
+* Implementation of the bump allocator and its per-thread sub-arenas.
+*
+* @author Borys Banaszkiewicz
+* @version 1.0
+*/
+
+#include "Arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Set up an empty arena with its sub-arenas.
+ *
+ * @param  arena: Pointer to the destination arena
+ * @param  block_size: Smallest size of a block in bytes, ARENA_BLOCK_SIZE when 0
+ * @param  threads: Number of sub-arenas, 0 for none
+ * @return 0 on success, -1 if the sub-arenas could not be allocated
+ */
+int initArena(struct Arena* arena, size_t block_size, int threads) {
+    memset(arena, 0, sizeof(struct Arena));
+    arena->block_size = block_size > 0 ? block_size : ARENA_BLOCK_SIZE;
+
+    if (threads > 0) {
+        arena->threads = (struct Arena**)calloc(threads, sizeof(struct Arena*));
+        if (!arena->threads) return -1;
+
+        // sub-arenas are written by different threads all the time, so none of them may share a cache line
+        size_t size = (sizeof(struct Arena) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+        for (int i = 0; i < threads; i++) {
+            void* memory = NULL;
+            if (posix_memalign(&memory, ARENA_ALIGNMENT, size) != 0) {
+                freeArena(arena);
+                return -1;
+            }
+            arena->threads[i] = (struct Arena*)memory;
+            arena->thread_count++;
+            initArena(arena->threads[i], arena->block_size, 0);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Get the sub-arena of one thread.
+ *
+ * @param  arena: The arena
+ * @param  thread: Index of the thread, 0 to the number of sub-arenas - 1
+ * @return the sub-arena
+ */
+struct Arena* threadArena(struct Arena* arena, int thread) {
+    return arena->threads[thread];
+}
+
+/**
+ * Allocate a block with room for at least size bytes after its data is aligned.
+ *
+ * @param  size: Bytes of data needed
+ * @return the block, or NULL if it could not be allocated
+ */
+static struct ArenaBlock* newBlock(size_t size) {
+    // the header goes in front of the data, rounded up so the data starts aligned
+    size_t header = (sizeof(struct ArenaBlock) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    void* memory = NULL;
+
+    if (posix_memalign(&memory, ARENA_ALIGNMENT, header + size) != 0) return NULL;
+
+    struct ArenaBlock* block = (struct ArenaBlock*)memory;
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    block->data = (unsigned char*)memory + header;
+    return block;
+}
+
+/**
+ * Take memory from an arena, aligned to ARENA_ALIGNMENT.
+ *
+ * @param  arena: The arena
+ * @param  size: Bytes needed
+ * @return the memory, or NULL if no block could be allocated
+ */
+void* allocArena(struct Arena* arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    // blocks kept from before the last reset are used again in order, a new block is only added after the
+    // current one when the next kept block is too small as well
+    while (!arena->current || arena->current->size - arena->current->used < size) {
+        if (arena->current && arena->current->next && arena->current->next->size >= size) {
+            arena->current = arena->current->next;
+            continue;
+        }
+
+        struct ArenaBlock* block = newBlock(size > arena->block_size ? size : arena->block_size);
+        if (!block) return NULL;
+
+        if (arena->current) {
+            block->next = arena->current->next;
+            arena->current->next = block;
+        }
+        else {
+            block->next = arena->first;
+            arena->first = block;
+        }
+        arena->current = block;
+    }
+
+    void* memory = arena->current->data + arena->current->used;
+    arena->current->used += size;
+    return memory;
+}
+
+/**
+ * Remember how much of an arena is in use.
+ *
+ * @param  arena: The arena
+ * @return the mark
+ */
+struct ArenaMark markArena(const struct Arena* arena) {
+    struct ArenaMark mark = {arena->current, arena->current ? arena->current->used : 0};
+    return mark;
+}
+
+/**
+ * Give back all memory taken from an arena since a mark was made.
+ *
+ * @param  arena: The arena
+ * @param  mark: A mark made by markArena on the same arena since its last reset
+ */
+void releaseArena(struct Arena* arena, struct ArenaMark mark) {
+    // blocks after the current one are still empty, so only the blocks filled since the mark are emptied
+    if (arena->current) {
+        struct ArenaBlock* block = mark.current ? mark.current->next : arena->first;
+        while (block && block != arena->current->next) {
+            block->used = 0;
+            block = block->next;
+        }
+    }
+
+    if (mark.current) {
+        mark.current->used = mark.used;
+        arena->current = mark.current;
+    }
+    else {
+        arena->current = arena->first;
+    }
+}
+
+/**
+ * Give back all memory taken from an arena and its sub-arenas at once.
+ *
+ * @param  arena: The arena
+ */
+void resetArena(struct Arena* arena) {
+    for (struct ArenaBlock* block = arena->first; block; block = block->next) {
+        block->used = 0;
+    }
+    arena->current = arena->first;
+
+    for (int i = 0; i < arena->thread_count; i++) {
+        resetArena(arena->threads[i]);
+    }
+}
+
+/**
+ * Release the blocks of an arena and its sub-arenas.
+ *
+ * @param  arena: The arena to release
+ */
+void freeArena(struct Arena* arena) {
+    struct ArenaBlock* block = arena->first;
+    while (block) {
+        struct ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+
+    for (int i = 0; i < arena->thread_count; i++) {
+        freeArena(arena->threads[i]);
+        free(arena->threads[i]);
+    }
+    free(arena->threads);
+    memset(arena, 0, sizeof(struct Arena));
+}
@@ -0,0 +1,108 @@
+/**
+* A bump allocator for the short-lived memory of filtering one image. Memory
+* is handed out from large blocks and never freed on its own; the whole arena
+* is reset in one call once the image is done, keeping its blocks for the
+* next image. Every thread gets a sub-arena of its own so workers never share
+* a lock or a cache line.
+*
+* @author Borys Banaszkiewicz
+* @version 1.0
+*/
+
+#ifndef Arena_H
+#define Arena_H 1
+
+#include <stddef.h>
+
+#define ARENA_ALIGNMENT 64
+#define ARENA_BLOCK_SIZE (256 * 1024)
+
+struct ArenaBlock {
+	struct ArenaBlock* next;	//next block of the same arena
+	size_t size;			//bytes of data in this block
+	size_t used;			//bytes of data handed out since the last reset
+	unsigned char* data;		//first byte of data, aligned to ARENA_ALIGNMENT
+};
+
+struct Arena {
+	struct ArenaBlock* first;	//blocks in the order they were added
+	struct ArenaBlock* current;	//block allocations are taken from
+	size_t block_size;		//smallest size of a new block
+	struct Arena** threads;		//sub-arenas, one per thread, each on cache lines of its own
+	int thread_count;
+};
+
+struct ArenaMark {
+	struct ArenaBlock* current;	//block allocations were taken from when the mark was made
+	size_t used;			//bytes of that block handed out when the mark was made
+};
+
+/**
+ * set up an empty arena with its sub-arenas. Blocks are only allocated when
+ * memory is first taken from an arena.
+ *
+ * @param  arena: Pointer to the destination arena
+ * @param  block_size: Smallest size of a block in bytes, ARENA_BLOCK_SIZE when 0
+ * @param  threads: Number of sub-arenas, 0 for none
+ * @return 0 on success, -1 if the sub-arenas could not be allocated
+ */
+int initArena(struct Arena* arena, size_t block_size, int threads);
+
+
+/**
+ * get the sub-arena of one thread. Only that thread may take memory from it.
+ *
+ * @param  arena: The arena
+ * @param  thread: Index of the thread, 0 to the number of sub-arenas - 1
+ * @return the sub-arena
+ */
+struct Arena* threadArena(struct Arena* arena, int thread);
+
+
+/**
+ * take memory from an arena, aligned to ARENA_ALIGNMENT. The memory stays
+ * valid until the arena is reset or freed.
+ *
+ * @param  arena: The arena
+ * @param  size: Bytes needed
+ * @return the memory, or NULL if no block could be allocated
+ */
+void* allocArena(struct Arena* arena, size_t size);
+
+
+/**
+ * remember how much of an arena is in use, so that memory taken for one task
+ * can be given back with releaseArena once the task is done.
+ *
+ * @param  arena: The arena
+ * @return the mark
+ */
+struct ArenaMark markArena(const struct Arena* arena);
+
+
+/**
+ * give back all memory taken from an arena since a mark was made. The blocks
+ * are kept and handed out again from the mark. Sub-arenas are left alone.
+ *
+ * @param  arena: The arena
+ * @param  mark: A mark made by markArena on the same arena since its last reset
+ */
+void releaseArena(struct Arena* arena, struct ArenaMark mark);
+
+
+/**
+ * give back all memory taken from an arena and its sub-arenas at once. The
+ * blocks are kept and handed out again from the start.
+ *
+ * @param  arena: The arena
+ */
+void resetArena(struct Arena* arena);
+
+
+/**
+ * release the blocks of an arena and its sub-arenas.
+ *
+ * @param  arena: The arena to release
+ */
+void freeArena(struct Arena* arena);
+#endif
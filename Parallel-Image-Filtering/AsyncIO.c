@@ -0,0 +1,307 @@
+/**
+* Implementation of the io_uring request queue and its synchronous fallback.
+*
+* @author Borys Banaszkiewicz
+* @version 1.0
+*/
+
+#include "AsyncIO.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// a single submission may not be longer than what fits the 32 bit length field
+#define ASYNC_IO_MAX_LENGTH (1u << 30)
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+#ifdef __NR_io_uring_setup
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+#else
+    (void)entries;
+    (void)params;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+#ifdef __NR_io_uring_enter
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+#else
+    (void)fd;
+    (void)to_submit;
+    (void)min_complete;
+    (void)flags;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+#ifdef __NR_io_uring_register
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+#else
+    (void)fd;
+    (void)opcode;
+    (void)arg;
+    (void)nr_args;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * Check that the kernel behind a ring knows the read and write opcodes. Kernels
+ * before 5.6 set up a ring but complete every IORING_OP_READ/IORING_OP_WRITE
+ * with -EINVAL. The probe came with the same kernel, so a failed probe means
+ * the opcodes are missing as well.
+ *
+ * @param  ring_fd: io_uring descriptor
+ * @return true if both opcodes are supported
+ */
+static bool supportsReadWrite(int ring_fd) {
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, size);
+    if (!probe) return false;
+
+    bool supported = io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0 &&
+                     probe->last_op >= IORING_OP_WRITE &&
+                     (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+                     (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+/**
+ * Carry out what is left of a request with pread/pwrite.
+ *
+ * @param  request: The request to finish
+ */
+static void transferSync(struct AsyncRequest* request) {
+    while (request->done < request->length) {
+        char* buffer = (char*)request->buffer + request->done;
+        size_t length = request->length - request->done;
+        off_t offset = request->offset + (off_t)request->done;
+        ssize_t n = request->write ? pwrite(request->fd, buffer, length, offset) : pread(request->fd, buffer, length, offset);
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            request->status = -1;
+            break;
+        }
+        request->done += (size_t)n;
+    }
+    request->complete = true;
+}
+
+/**
+ * Put the remaining part of a request on the submission queue and hand it to the kernel.
+ * If the kernel does not take it, the request is carried out with pread/pwrite instead.
+ *
+ * @param  io: The context
+ * @param  request: The request to queue
+ */
+static void queueRequest(struct AsyncIO* io, struct AsyncRequest* request) {
+    unsigned tail = *io->sq_tail;
+    unsigned index = tail & *io->sq_mask;
+    struct io_uring_sqe* sqe = &((struct io_uring_sqe*)io->sqes)[index];
+    size_t length = request->length - request->done;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = request->fd;
+    sqe->addr = (unsigned long long)(unsigned long)((char*)request->buffer + request->done);
+    sqe->len = length > ASYNC_IO_MAX_LENGTH ? ASYNC_IO_MAX_LENGTH : (unsigned)length;
+    sqe->off = (unsigned long long)(request->offset + (off_t)request->done);
+    sqe->user_data = (unsigned long long)(unsigned long)request;
+    io->sq_array[index] = index;
+
+    // the entry has to be visible to the kernel before the new tail is
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    int submitted;
+    while ((submitted = io_uring_enter(io->ring_fd, 1, 0, 0)) < 0 && errno == EINTR);
+    if (submitted < 1) {
+        // without SQPOLL the kernel only reads entries inside io_uring_enter, so the entry can be taken back
+        __atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+        transferSync(request);
+        return;
+    }
+    io->in_flight++;
+}
+
+/**
+ * Wait for at least one completion and process everything on the completion queue.
+ * Short transfers are queued again for the bytes that are left, failed transfers
+ * are finished with pread/pwrite.
+ *
+ * @param  io: The context
+ */
+static void reapCompletions(struct AsyncIO* io) {
+    unsigned head = *io->cq_head;
+
+    if (head == __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+        int waited;
+        while ((waited = io_uring_enter(io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS)) < 0 && errno == EINTR);
+
+        // the kernel still owns the buffers of the requests in flight and posts their completions without
+        // being asked, so when it refuses to wait they are polled for with a short sleep in between
+        if (waited < 0) {
+            struct timespec pause = {0, 1000000};
+            while (head == __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+                nanosleep(&pause, NULL);
+            }
+        }
+    }
+
+    while (head != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &((struct io_uring_cqe*)io->cqes)[head & *io->cq_mask];
+        struct AsyncRequest* request = (struct AsyncRequest*)(unsigned long)cqe->user_data;
+        int result = cqe->res;
+
+        head++;
+        __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+        io->in_flight--;
+
+        if (result == -EINTR || result == -EAGAIN) {
+            queueRequest(io, request);
+        }
+        else if (result <= 0) {
+            // an opcode the kernel does not support fails the same way as a real error, so both are left to
+            // pread/pwrite, which picks up after the bytes already transferred
+            transferSync(request);
+        }
+        else {
+            request->done += (size_t)result;
+            if (request->done < request->length) {
+                queueRequest(io, request);
+            }
+            else {
+                request->complete = true;
+            }
+        }
+    }
+}
+
+/**
+ * Set up an io_uring instance, falling back to synchronous I/O if that fails.
+ *
+ * @param  io: Pointer to the destination context
+ * @param  entries: Number of requests that can be queued at once
+ * @return true if io_uring is used, false if requests run synchronously
+ */
+bool initAsyncIO(struct AsyncIO* io, unsigned entries) {
+    struct io_uring_params params;
+    memset(io, 0, sizeof(*io));
+    memset(&params, 0, sizeof(params));
+    io->ring_fd = io_uring_setup(entries, &params);
+    if (io->ring_fd < 0) {
+        io->ring_fd = -1;
+        return false;
+    }
+    if (!supportsReadWrite(io->ring_fd)) {
+        close(io->ring_fd);
+        io->ring_fd = -1;
+        return false;
+    }
+
+    io->entries = params.sq_entries;
+    io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (io->cq_ring_size > io->sq_ring_size) io->sq_ring_size = io->cq_ring_size;
+        io->cq_ring_size = io->sq_ring_size;
+    }
+
+    io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQ_RING);
+    io->cq_ring = io->sq_ring;
+    if (io->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_CQ_RING);
+    }
+    io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES);
+
+    if (io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED) {
+        if (io->sqes != MAP_FAILED) munmap(io->sqes, io->sqes_size);
+        if (io->cq_ring != MAP_FAILED && io->cq_ring != io->sq_ring) munmap(io->cq_ring, io->cq_ring_size);
+        if (io->sq_ring != MAP_FAILED) munmap(io->sq_ring, io->sq_ring_size);
+        close(io->ring_fd);
+        memset(io, 0, sizeof(*io));
+        io->ring_fd = -1;
+        return false;
+    }
+
+    char* sq = (char*)io->sq_ring;
+    char* cq = (char*)io->cq_ring;
+    io->sq_head = (unsigned*)(sq + params.sq_off.head);
+    io->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    io->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    io->sq_array = (unsigned*)(sq + params.sq_off.array);
+    io->cq_head = (unsigned*)(cq + params.cq_off.head);
+    io->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    io->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    io->cqes = cq + params.cq_off.cqes;
+    return true;
+}
+
+/**
+ * Queue a read or write. With the synchronous fallback the request is complete on return.
+ *
+ * @param  io: The context
+ * @param  request: The request to submit, must stay valid until it is complete
+ */
+void submitAsyncIO(struct AsyncIO* io, struct AsyncRequest* request) {
+    request->done = 0;
+    request->status = 0;
+    request->complete = false;
+
+    if (io->ring_fd < 0 || request->length == 0) {
+        transferSync(request);
+        return;
+    }
+
+    // short transfers are queued again when reaped, so keep one entry spare for every request in flight
+    while (io->in_flight >= io->entries) {
+        reapCompletions(io);
+    }
+    queueRequest(io, request);
+}
+
+/**
+ * Wait until a request is complete, handling completions of other requests on the way.
+ *
+ * @param  io: The context
+ * @param  request: The request to wait for
+ * @return 0 if the request succeeded, -1 otherwise
+ */
+int waitAsyncIO(struct AsyncIO* io, struct AsyncRequest* request) {
+    while (!request->complete) {
+        reapCompletions(io);
+    }
+    return request->status;
+}
+
+/**
+ * Wait for every submitted request and release the context.
+ *
+ * @param  io: The context to release
+ */
+void closeAsyncIO(struct AsyncIO* io) {
+    if (io->ring_fd < 0) return;
+
+    while (io->in_flight > 0) {
+        reapCompletions(io);
+    }
+
+    munmap(io->sqes, io->sqes_size);
+    if (io->cq_ring != io->sq_ring) munmap(io->cq_ring, io->cq_ring_size);
+    munmap(io->sq_ring, io->sq_ring_size);
+    close(io->ring_fd);
+    io->ring_fd = -1;
+}
@@ -0,0 +1,83 @@
+/**
+* Asynchronous file reads and writes built on io_uring. When io_uring is not
+* available (old kernel, seccomp profile, ...) every request is carried out
+* synchronously with pread/pwrite when it is submitted.
+*
+* @author Borys Banaszkiewicz
+* @version 1.0
+*/
+
+#ifndef AsyncIO_H
+#define AsyncIO_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct AsyncIO {
+	int ring_fd;		//io_uring descriptor, -1 when requests run synchronously
+	unsigned entries;	//number of submission queue entries
+	unsigned in_flight;	//requests submitted and not yet completed
+	void* sq_ring;		//mapped submission queue ring
+	size_t sq_ring_size;
+	void* cq_ring;		//mapped completion queue ring, may be the same mapping as sq_ring
+	size_t cq_ring_size;
+	void* sqes;		//mapped submission queue entries
+	size_t sqes_size;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	void* cqes;
+};
+
+struct AsyncRequest {
+	int fd;			//descriptor of the file
+	void* buffer;		//memory being read into or written from
+	size_t length;		//number of bytes to transfer
+	off_t offset;		//file offset of the first byte
+	bool write;		//true for a write, false for a read
+	size_t done;		//bytes transferred so far
+	int status;		//0 on success, -1 if the transfer failed
+	bool complete;		//set once the whole request finished or failed
+};
+
+/**
+ * set up an io_uring instance, falling back to synchronous I/O if that fails.
+ *
+ * @param  io: Pointer to the destination context
+ * @param  entries: Number of requests that can be queued at once
+ * @return true if io_uring is used, false if requests run synchronously
+ */
+bool initAsyncIO(struct AsyncIO* io, unsigned entries);
+
+
+/**
+ * queue a read or write. With the synchronous fallback the request is complete on return.
+ *
+ * @param  io: The context
+ * @param  request: The request to submit, must stay valid until it is complete
+ */
+void submitAsyncIO(struct AsyncIO* io, struct AsyncRequest* request);
+
+
+/**
+ * wait until a request is complete, handling completions of other requests on the way.
+ *
+ * @param  io: The context
+ * @param  request: The request to wait for
+ * @return 0 if the request succeeded, -1 otherwise
+ */
+int waitAsyncIO(struct AsyncIO* io, struct AsyncRequest* request);
+
+
+/**
+ * wait for every submitted request and release the context.
+ *
+ * @param  io: The context to release
+ */
+void closeAsyncIO(struct AsyncIO* io);
+#endif
@@ -16,10 +16,18 @@
 #include <math.h>
 #include <time.h>
 #include <stdbool.h>
+#include <ctype.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 //UNCOMMENT BELOW LINE IF USING SER334 LIBRARY/OBJECT FOR BMP SUPPORT
 #include "BmpProcessor.h"
+#include "AsyncIO.h"
+#include "QoiProcessor.h"
+#include "ThreadPool.h"
+#include "Arena.h"
+#include "BlurKernels.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //MACRO DEFINITIONS
@@ -27,93 +35,323 @@
 #define BMP_HEADER_SIZE 14
 #define BMP_DIB_HEADER_SIZE 40
 #define MAXIMUM_IMAGE_SIZE 4096
-#define THREAD_COUNT 11
+#define READ_AHEAD 2
+#define L2_CACHE_SIZE 262144 //used for the tile size when the cache size cannot be queried
+//estimated cost of the work done on one pixel, measured relative to each other
+#define COST_PIXEL 1        //copied or made yellow
+#define COST_BLUR_PIXEL 16  //blurred through the window
+#define COST_HOLE_PIXEL 1   //visited by draw_holes for one hole
+#define MAX_BLUR_RADIUS 255 //keeps the sums of a box within an unsigned int
+#define GAUSSIAN_SIGMA 2.0          //sigma of the gaussian blur when none is given
+#define MIN_GAUSSIAN_SIGMA 0.5      //smallest sigma the recursive filter is fitted for
+#define MAX_GAUSSIAN_SIGMA 100.0
+#define GAUSSIAN_BLOCK 64           //columns the vertical pass of the gaussian blur runs down together
+#define USAGE "Usage: %s -i <input file> -o <output file> [-i <input file> -o <output file> ...] -f <filter>[radius|sigma] [-m mmap|stdio|parallel|async] [-l interleaved|planar] [-p rows|cols|tiles] [-E] [-B pingpong|inplace] [-n <iterations>] [-s scalar|sse2|avx2|avx512] [-t <threads>|auto] [-a] [-N] [-v]\n"
 
-////////////////////////////////////////////////////////////////////////////////
-//DATA STRUCTURES
-struct thread_info {
-    int start;
-    int end;
-    struct Pixel** data;
+enum io_mode {
+    IO_STDIO,
+    IO_MMAP,
+    IO_PARALLEL,
+    IO_ASYNC
+};
+
+enum partition {
+    PARTITION_ROWS,     //bands of whole rows, the blur reads a few more rows above and below
+    PARTITION_COLS,     //strips of whole columns, the blur reads a few more columns on each side
+    PARTITION_TILES     //tiles that fit in the L2 cache, shared out by work stealing
 };
 
+////////////////////////////////////////////////////////////////////////////////
+//DATA STRUCTURES
 struct filter_args {
-    struct Pixel** pArr;
-    int width;
-    int height;
-    int start_x;
-    int end_x;
+    const struct Image* source;     //image the filters read, shared by every region
+    struct Image* output;           //image the filters write, shared by every region, may be the source when nothing is blurred
+    int start_x;                    //first column of this region
+    int end_x;                      //one past the last column of this region
+    int start_y;                    //first row of this region
+    int end_y;                      //one past the last row of this region
+    int halo_start_x;               //first column the blur of this region reads
+    int halo_end_x;                 //one past the last column the blur of this region reads
+    int halo_start_y;               //first row the blur of this region reads
+    int halo_end_y;                 //one past the last row the blur of this region reads
+    enum image_format window;       //layout of the rows the blur works on
+    int radius;                     //the blur averages boxes of 2 * radius + 1 pixels on each side
+    int iterations;                 //number of times the blur is applied
+    const struct BlurKernels* kernels; //inner loops of the blur picked for the CPU
     int** coordinates;
     int* radii;
     int holes_total;
     bool blur;
+    bool yellow;
+    bool holes;
+    bool in_place;                  //blur and holes depend on where the regions are cut, as when every region had its own copy
+    struct Arena* arena;            //memory for this image, with one sub-arena per worker
+};
+
+struct filter_options {
+    bool blur;
+    int radius;                 //radius of the blur box, 1 for the original 3x3 box
+    int iterations;             //number of times the blur is applied, in blocks that stay in the cache
+    const struct BlurKernels* kernels; //inner loops of the blur, the widest the CPU supports unless -s picks others
+    bool gaussian;              //recursive gaussian blur instead of the box blur
+    double sigma;               //standard deviation of the gaussian blur in pixels
     bool cheese;
+    bool yellow;                //yellow filter on its own, without the holes of the cheese filter
+    enum image_format layout;   //layout of images held in memory and of the blur rows, IMAGE_BGRX32 or IMAGE_PLANAR
+    enum partition partition;   //how the image is cut into regions, one per task
+    bool numa;                  //every band runs on the same worker that first touched its memory
+    bool verbose;               //report the pages every image allocated for filtering got
+    bool balance;               //size bands and strips by the estimated cost of their holes instead of by area
+    bool in_place;              //blur each region in place, the result then depends on how the image is cut
+};
+
+struct gaussian_args {
+    const struct Image* source;     //image the horizontal pass reads
+    struct Image* output;           //image the vertical pass writes
+    float* planes;                  //result of the horizontal pass, one plane of width * height floats per channel
+    double coefficients[4];         //B, b1 / b0, b2 / b0 and b3 / b0 of the recursive filter
+    int start;                      //first row of the band or column of the block
+    int end;                        //one past the last row or column
+    struct Arena* arena;            //memory for this image, with one sub-arena per worker
+};
+
+struct band_args {
+    struct Image* image;
+    int start_y;
+    int end_y;
+};
+
+struct batch_item {
+    int in_fd;
+    int out_fd;
+    void* input;
+    struct AsyncRequest read;
+    struct BMP_Mapping output;
+    struct AsyncRequest write;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 //MAIN PROGRAM CODE
-void box_blur_filter(struct filter_args* args) {
-    int offset[][2] = {{-1, -1}, {1, -1}, {-1, 1}, {1, 1}, {-1, 0}, {0, -1}, {0, 1}, {1, 0}, {0, 0}};
+// the in place blur takes every neighbour as it is and averages them. the interior always divides by 9, which
+// (total * 7282) >> 16 does exactly for every total up to 9 * 255
+#define BOX_TAKE(value) (value)
+#define BOX_AVERAGE(total, count) ((count) == 9 ? (total) * 7282 >> 16 : (total) / (count))
 
-    for (int h = 0; h < args->height; h++) {
-        for (int w = 0; w < args->width; w++) {
-            int r = 0, g = 0, b = 0, count = 0;
+// the row is blurred in place from left to right, so the pixel to the left already holds its blurred value
+// while the pixel to the right still holds its original one
+DEFINE_NEIGHBORHOOD_ROW(box_blur_row, BOX_TAKE, BOX_AVERAGE)
 
-            for (int i = 0; i < 9; i++) {
-                int h_offset = h + offset[i][0];
-                int w_offset = w + offset[i][1];
+void box_blur_in_place(struct filter_args* args, struct Image* window, int width, int step) {
+    // three rows slide down the halo of the region: the blurred row above, the row being blurred and the
+    // original row below. rows below the region are never blurred, the last row of the region only reads the
+    // first of them
+    copyImageRect(window, 0, args->halo_start_y % 3, args->source, args->halo_start_x, args->halo_start_y, width, 1);
 
-                if (h_offset < 0 || h_offset >= args->height || w_offset < 0 || w_offset >= args->width) continue;
+    for (int h = args->halo_start_y; h < args->end_y; h++) {
+        bool has_below = h + 1 < args->halo_end_y;
 
-                r += args->pArr[h_offset][w_offset].red;
-                g += args->pArr[h_offset][w_offset].green;
-                b += args->pArr[h_offset][w_offset].blue;
+        if (has_below) {
+            copyImageRect(window, 0, (h + 1) % 3, args->source, args->halo_start_x, h + 1, width, 1);
+        }
+        for (int c = 0; c < 3; c++) {
+            unsigned char* row = imageChannel(window, c, 0, h % 3);
+            box_blur_row(h > args->halo_start_y ? imageChannel(window, c, 0, (h + 2) % 3) : NULL, row,
+                         has_below ? imageChannel(window, c, 0, (h + 1) % 3) : NULL, step, width);
+        }
+        if (h >= args->start_y) {
+            copyImageRect(args->output, args->start_x, h, window, args->start_x - args->halo_start_x, h % 3, args->end_x - args->start_x, 1);
+        }
+    }
+}
 
-                count++;
-            }
+void box_blur_add_row(struct filter_args* args, struct Image* window, unsigned int* sums, unsigned int* columns, int y, int width, int step) {
+    // the row is widened into the window, its horizontal sums are kept in slot y of the ring until the row
+    // leaves the box again and are added to the columns of the region. interleaved rows are summed as one run
+    // of BGRX bytes, planar rows as three planes
+    int planes = step == 1 ? 3 : 1;
+    int lanes = width * step;
+    unsigned int* slot = sums + (size_t)(y % (2 * args->radius + 1)) * planes * lanes;
+    int first = (args->start_x - args->halo_start_x) * step;
+    int count = (args->end_x - args->start_x) * step;
 
-            args->pArr[h][w].red = (unsigned char)(r/count);
-            args->pArr[h][w].green = (unsigned char)(g/count);
-            args->pArr[h][w].blue = (unsigned char)(b/count);
+    copyImageRect(window, 0, 0, args->source, args->halo_start_x, y, width, 1);
+    for (int p = 0; p < planes; p++) {
+        args->kernels->sums(imageChannel(window, p, 0, 0), slot + p * lanes, width, step, args->radius);
+        args->kernels->border(columns + p * lanes + first, slot + p * lanes + first, NULL, NULL, NULL, count);
+    }
+}
+
+void box_blur_columns(void (*kernel)(unsigned int*, const unsigned int*, const unsigned int*, const struct BlurDivisor*, unsigned char*, int),
+                      unsigned int* columns, const unsigned int* enter, const unsigned int* leave, const struct BlurDivisor* divisor,
+                      unsigned char* out, int first, int last) {
+    // runs the kernel over the sums first to last of a plane, the widths of the boxes are looked up from first on
+    struct BlurDivisor part = *divisor;
+
+    if (first >= last) return;
+    part.across = divisor->across + first;
+    kernel(columns + first, enter ? enter + first : NULL, leave ? leave + first : NULL, &part, out + first, last - first);
+}
+
+void box_blur_ping_pong(struct filter_args* args, struct Image* window, unsigned int* sums, int width, int step) {
+    // the box is separable: every source row is summed horizontally once and the column sums of the region slide
+    // down over the 2 * radius + 1 rows of the box, so every pixel costs the same for any radius and only ever
+    // sees original neighbours. the sums are divided by the number of pixels of the box inside the image, so
+    // radius 1 gives exactly the 3x3 blur. the window holds the row being summed and the blurred row
+    int radius = args->radius;
+    int height = args->source->height;
+    int planes = step == 1 ? 3 : 1;
+    int lanes = width * step;
+    int first = (args->start_x - args->halo_start_x) * step;
+    int last = (args->end_x - args->halo_start_x) * step;
+    unsigned int* columns = sums + (size_t)(2 * radius + 1) * planes * lanes;
+    unsigned int* across = columns + (size_t)planes * lanes;
+    struct BlurDivisor divisor;
+
+    // only the columns whose box reaches past the edge of the image need the border kernels, every other box
+    // of a row has 2 * radius + 1 columns and the interior kernels divide them by the same number
+    int interior_first = radius * step > first ? (radius * step < last ? radius * step : last) : first;
+    int interior_last = (width - radius) * step < last ? (width - radius) * step : last;
+    if (interior_last < interior_first) interior_last = interior_first;
+    divisor.across = across;
+
+    // the number of pixels of a box inside the row only depends on its column
+    for (int l = 0; l < lanes; l++) {
+        int w = l / step;
+        across[l] = (unsigned int)((w + radius < width ? w + radius + 1 : width) - (w > radius ? w - radius : 0));
+    }
+    memset(columns, 0, sizeof(unsigned int) * planes * lanes);
+    for (int y = args->start_y > radius ? args->start_y - radius : 0; y < args->start_y + radius && y < height; y++) {
+        box_blur_add_row(args, window, sums, columns, y, width, step);
+    }
+
+    for (int h = args->start_y; h < args->end_y; h++) {
+        unsigned int* enter = NULL;
+        unsigned int* leave = NULL;
+        divisor.rows = (unsigned int)((h + radius < height ? h + radius + 1 : height) - (h > radius ? h - radius : 0));
+        setBlurDivisor(&divisor, divisor.rows * (2 * radius + 1));
+
+        // the row entering the box is summed into its slot and added together with the averages, the top row
+        // leaves the box right after them
+        if (h + radius < height) {
+            copyImageRect(window, 0, 0, args->source, args->halo_start_x, h + radius, width, 1);
+            enter = sums + (size_t)((h + radius) % (2 * radius + 1)) * planes * lanes;
+        }
+        if (h - radius >= 0) {
+            leave = sums + (size_t)((h - radius) % (2 * radius + 1)) * planes * lanes;
         }
+        for (int p = 0; p < planes; p++) {
+            if (enter) {
+                args->kernels->sums(imageChannel(window, p, 0, 0), enter + p * lanes, width, step, radius);
+            }
+            box_blur_columns(args->kernels->border, columns + p * lanes, enter ? enter + p * lanes : NULL,
+                             leave ? leave + p * lanes : NULL, &divisor, imageChannel(window, p, 0, 1), first, interior_first);
+            box_blur_columns(args->kernels->interior, columns + p * lanes, enter ? enter + p * lanes : NULL,
+                             leave ? leave + p * lanes : NULL, &divisor, imageChannel(window, p, 0, 1), interior_first, interior_last);
+            box_blur_columns(args->kernels->border, columns + p * lanes, enter ? enter + p * lanes : NULL,
+                             leave ? leave + p * lanes : NULL, &divisor, imageChannel(window, p, 0, 1), interior_last, last);
+        }
+        copyImageRect(args->output, args->start_x, h, window, args->start_x - args->halo_start_x, 1, args->end_x - args->start_x, 1);
+    }
+}
+
+void box_blur_filter(struct filter_args* args, struct Arena* arena) {
+    int width = args->halo_end_x - args->halo_start_x;
+    int rows = args->in_place ? 3 : 2;
+    int step = channelStep(args->window);
+    struct Image window;
+
+    // only the source is read and only the rows and columns of the region are written. the window, the ring of
+    // row sums, the column sums and the box widths come from the arena of the worker and are given back once the
+    // region is done
+    size_t sums_size = sizeof(unsigned int) * ((size_t)(2 * args->radius + 2) * (step == 1 ? 3 : 1) + 1) * width * step;
+    void* block = allocArena(arena, imageBlockSize(width, rows, args->window));
+    unsigned int* sums = args->in_place ? NULL : (unsigned int*)allocArena(arena, sums_size);
+    if (!block || (!args->in_place && !sums)) {
+        fprintf(stderr, "Error: Unable to allocate image.\n");
+        exit(EXIT_FAILURE);
+    }
+    layoutImage(&window, block, width, rows, args->window);
+
+    if (args->in_place) {
+        box_blur_in_place(args, &window, width, step);
+    }
+    else {
+        box_blur_ping_pong(args, &window, sums, width, step);
     }
 }
 
 void yellow_filter(struct filter_args* args) {
-    for (int h = 0; h < args->height; h++) {
-        for (int w = 0; w < args->width; w++) {
-            args->pArr[h][w].blue = 0;
+    int width = args->end_x - args->start_x;
+    int step = channelStep(args->output->format);
+
+    for (int h = args->start_y; h < args->end_y; h++) {
+        unsigned char* blue = imageChannel(args->output, PLANE_BLUE, args->start_x, h);
+
+        // the blue bytes of a planar row are next to each other, so they are cleared in one go
+        if (args->output->format == IMAGE_PLANAR) {
+            memset(blue, 0, (size_t)width);
+            continue;
+        }
+        for (int w = 0; w < width; w++) {
+            blue[w * step] = 0;
         }
     }
 }
 
-void draw_holes(struct filter_args* args) {
+void yellow_palette_filter(struct Pixel32* palette) {
+    // indexed images only change their colors, every pixel using an entry follows along
+    for (int i = 0; i < IMAGE_PALETTE_SIZE; i++) {
+        palette[i].blue = 0;
+    }
+}
+
+int hole_smoothing(const struct filter_args* args, int i) {
     int hole_small = pow(args->holes_total * 0.65, 2); // 1.31 smooth
     int hole_medium = pow(args->holes_total, 2); //1.2 smooth
-    int hole_large = pow(args->holes_total * 1.35, 2); //1.13 smooth
 
+    // squared radius of the smoothing ring around hole i, hole_large gets 1.13
+    return args->radii[i] == hole_small ? args->radii[i] * 1.31 : args->radii[i] == hole_medium ? args->radii[i] * 1.2 : args->radii[i] * 1.13;
+}
+
+void draw_holes(struct filter_args* args) {
     for (int i = 0; i < args->holes_total; i++) {
         double radius = sqrt(args->radii[i]);
-        int smoothing_radius = args->radii[i] == hole_small ? args->radii[i] * 1.31 : args->radii[i] == hole_medium ? args->radii[i] * 1.2 : args->radii[i] * 1.13;
+        int smoothing_radius = hole_smoothing(args, i);
         int x_center = args->coordinates[i][0];
         int y_center = args->coordinates[i][1];
         int x_left = x_center - ceil(radius);
         int x_right = x_center + ceil(radius);
+        int y_top = y_center - ceil(radius);
+        int y_bottom = y_center + ceil(radius);
+
+        // in place, a hole is drawn by every region whose halo reaches its core, exactly like when every region
+        // had its own copy. otherwise every region draws every hole its smoothing ring reaches, so the result does
+        // not depend on the regions. only the rows and columns of the region the smoothing ring can reach are visited
+        if (!args->in_place || (x_left <= args->halo_end_x && x_right >= args->halo_start_x && y_top <= args->halo_end_y && y_bottom >= args->halo_start_y)) {
+            int reach = (int)ceil(sqrt(smoothing_radius)) + 1;
+            int top = y_center - reach > args->start_y ? y_center - reach : args->start_y;
+            int bottom = y_center + reach < args->end_y ? y_center + reach + 1 : args->end_y;
+            int left = x_center - reach > args->start_x ? x_center - reach : args->start_x;
+            int right = x_center + reach < args->end_x ? x_center + reach + 1 : args->end_x;
+            int step = channelStep(args->output->format);
+
+            for (int h = top; h < bottom; h++) {
+                unsigned char* blue = imageChannel(args->output, PLANE_BLUE, 0, h);
+                unsigned char* green = imageChannel(args->output, PLANE_GREEN, 0, h);
+                unsigned char* red = imageChannel(args->output, PLANE_RED, 0, h);
 
-        if (x_left <= args->end_x && x_right >= args->start_x) {
-            for (int h = 0; h < args->height; h++) {
-                for (int w = 0; w < args->width; w++) {
-                    int distance = pow((w + args->start_x) - x_center, 2) + pow(h - y_center, 2);
+                for (int w = left; w < right; w++) {
+                    int distance = pow(w - x_center, 2) + pow(h - y_center, 2);
+
+                    // pixels inside the hole turn black, the ones in the smoothing ring fade towards it
                     if (distance <= args->radii[i]) {
-                        args->pArr[h][w].red = (unsigned char)0;
-                        args->pArr[h][w].green = (unsigned char)0;
-                        args->pArr[h][w].blue = (unsigned char)0;
+                        blue[w * step] = green[w * step] = red[w * step] = (unsigned char)0;
                     }
-                    if (distance <= smoothing_radius) {
+                    else if (distance <= smoothing_radius) {
                         double smooth = (double) (distance - args->radii[i]) / (smoothing_radius - args->radii[i]);
-                        args->pArr[h][w].red = (unsigned char) (args->pArr[h][w].red * smooth);
-                        args->pArr[h][w].green = (unsigned char) (args->pArr[h][w].green * smooth);
-                        args->pArr[h][w].blue = (unsigned char) (args->pArr[h][w].blue * smooth);
+                        red[w * step] = (unsigned char) (red[w * step] * smooth);
+                        green[w * step] = (unsigned char) (green[w * step] * smooth);
+                        blue[w * step] = (unsigned char) (blue[w * step] * smooth);
                     }
                 }
             }
@@ -121,7 +359,7 @@ void draw_holes(struct filter_args* args) {
     }
 }
 
-int* calculate_holes(struct Pixel** pArr, int height, int width, int holes_total) {
+int* calculate_holes(struct Arena* arena, struct Image* image, int height, int width, int holes_total) {
     srand(time(NULL));
 
     //distribute holes into count of small, medium and large holes (medium being most common)
@@ -135,7 +373,11 @@ int* calculate_holes(struct Pixel** pArr, int height, int width, int holes_total
     int radius_squared_large = pow(holes_total * 1.35, 2);
 
     // initialize array to store each hole
-    int *hole_random = (int*)malloc(sizeof(int)*holes_total);
+    int *hole_random = (int*)allocArena(arena, sizeof(int)*holes_total);
+    if (!hole_random) {
+        fprintf(stderr, "Error: Unable to allocate holes.\n");
+        exit(EXIT_FAILURE);
+    }
 
     for (int i = 0; i < holes_total; i++) {
         if (i < holes_small_count) {
@@ -158,7 +400,7 @@ int* calculate_holes(struct Pixel** pArr, int height, int width, int holes_total
     return hole_random;
 }
 
-int** calculate_random_coordinates(int height, int width, int holes_total) {
+int** calculate_random_coordinates(struct Arena* arena, int height, int width, int holes_total) {
     srand(time(NULL));
     // calculates the nxm (gridHeight x gridWidth) grids that will be used to uniformly distribute the holes
     int gridsVertical = (int) round(sqrt((double) holes_total * width / height));
@@ -171,9 +413,18 @@ int** calculate_random_coordinates(int height, int width, int holes_total) {
     int gridHeight = width / gridsVertical;
     int gridWidth = height / gridsHorizontal;
 
-    int **random_coordinates = (int**)malloc(sizeof(int*) * holes_total);
+    // the pointers and all coordinate pairs come from the arena in one piece
+    int **random_coordinates = (int**)allocArena(arena, (sizeof(int*) + sizeof(int) * 2) * holes_total);
+    if (!random_coordinates) {
+        fprintf(stderr, "Error: Unable to allocate holes.\n");
+        exit(EXIT_FAILURE);
+    }
+    // the grid does not always have a cell for every hole. the holes left over are put so far outside the image
+    // that not even their smoothing ring reaches it, instead of wherever the memory they were given points
+    int *pairs = (int*)(random_coordinates + holes_total);
     for (int i = 0; i < holes_total; i++) {
-        random_coordinates[i] = (int *) malloc(sizeof(int) * 2);
+        random_coordinates[i] = pairs + 2 * i;
+        random_coordinates[i][0] = random_coordinates[i][1] = -(width + height);
     }
 
     int index = 0;
@@ -192,230 +443,1007 @@ int** calculate_random_coordinates(int height, int width, int holes_total) {
     return random_coordinates;
 }
 
-void* apply_filters(void* arg) {
+void set_region(struct filter_args* args, int start_x, int end_x, int start_y, int end_y) {
+    // the blur of a region reads radius more rows and columns on each side without storing them. in place it
+    // always reads 2, as the original 3x3 blur of a region did
+    int halo = args->in_place ? 2 : args->radius;
+
+    args->start_x = start_x;
+    args->end_x = end_x;
+    args->start_y = start_y;
+    args->end_y = end_y;
+    args->halo_start_x = start_x > halo ? start_x - halo : 0;
+    args->halo_end_x = end_x + halo < args->source->width ? end_x + halo : args->source->width;
+    args->halo_start_y = start_y > halo ? start_y - halo : 0;
+    args->halo_end_y = end_y + halo < args->source->height ? end_y + halo : args->source->height;
+}
+
+int tile_side(void) {
+    long cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (cache <= 0) cache = L2_CACHE_SIZE;
+
+    // a tile of the source and the same tile of the output have to fit in the cache together
+    int side = (int) sqrt((double) cache / (2 * sizeof(struct Pixel32)));
+    return side > 16 ? side / 16 * 16 : 16;
+}
+
+void box_blur_iterations(struct filter_args* args, struct Arena* arena) {
+    // every block of the region is blurred iterations times while it stays in the cache, instead of the whole
+    // image once per iteration. a block is read with a halo of radius pixels per iteration, and every iteration
+    // blurs the block and what is left of its halo into the other of two images, one radius smaller on each
+    // side, so the last one leaves exactly the block. only the edges of the image cut the boxes short, so the
+    // result is the same as blurring the whole image iterations times
+    int halo = args->radius * args->iterations;
+    int side = tile_side() - 2 * halo > 4 * halo ? tile_side() - 2 * halo : 4 * halo;
+    int most = side + 2 * halo;
+    int step = channelStep(args->window);
+    struct Image images[2], window;
+
+    void* blocks[2] = {allocArena(arena, imageBlockSize(most, most, args->window)), allocArena(arena, imageBlockSize(most, most, args->window))};
+    void* window_block = allocArena(arena, imageBlockSize(most, 2, args->window));
+    unsigned int* sums = (unsigned int*)allocArena(arena, sizeof(unsigned int) * ((size_t)(2 * args->radius + 2) * (step == 1 ? 3 : 1) + 1) * most * step);
+    if (!blocks[0] || !blocks[1] || !window_block || !sums) {
+        fprintf(stderr, "Error: Unable to allocate image.\n");
+        exit(EXIT_FAILURE);
+    }
+    layoutImage(&window, window_block, most, 2, args->window);
+
+    for (int y = args->start_y; y < args->end_y; y += side) {
+        for (int x = args->start_x; x < args->end_x; x += side) {
+            int end_x = x + side < args->end_x ? x + side : args->end_x;
+            int end_y = y + side < args->end_y ? y + side : args->end_y;
+            int left = x > halo ? x - halo : 0;
+            int top = y > halo ? y - halo : 0;
+            int right = end_x + halo < args->source->width ? end_x + halo : args->source->width;
+            int bottom = end_y + halo < args->source->height ? end_y + halo : args->source->height;
+            int current = 0;
+
+            layoutImage(&images[0], blocks[0], right - left, bottom - top, args->window);
+            layoutImage(&images[1], blocks[1], right - left, bottom - top, args->window);
+            copyImageRect(&images[0], 0, 0, args->source, left, top, right - left, bottom - top);
+
+            for (int k = 1; k <= args->iterations; k++) {
+                struct filter_args pass = *args;
+                int grow = args->radius * (args->iterations - k);
+
+                // the pass blurs the block grown by what the later iterations still need, in the coordinates of the block
+                pass.source = &images[current];
+                pass.output = &images[1 - current];
+                set_region(&pass, (x - grow > left ? x - grow : left) - left, (end_x + grow < right ? end_x + grow : right) - left,
+                           (y - grow > top ? y - grow : top) - top, (end_y + grow < bottom ? end_y + grow : bottom) - top);
+                box_blur_ping_pong(&pass, &window, sums, pass.halo_end_x - pass.halo_start_x, step);
+                current = 1 - current;
+            }
+            copyImageRect(args->output, x, y, &images[current], x - left, y - top, end_x - x, end_y - y);
+        }
+    }
+}
+
+void apply_filters(void* arg, int worker) {
     struct filter_args* args = (struct filter_args*)arg;
+    // the blur windows are only needed while the region is filtered, so a worker reuses the same memory for
+    // every region it takes instead of keeping one set per region until the image is done
+    struct Arena* scratch = threadArena(args->arena, worker);
+    struct ArenaMark mark = markArena(scratch);
 
-    if (args->blur) {
-        box_blur_filter(args);
+    // every region only writes its own pixels of the output, the blur stores them as it goes
+    if (args->blur && args->iterations > 1) {
+        box_blur_iterations(args, scratch);
     }
-    if (args->cheese) {
+    else if (args->blur) {
+        box_blur_filter(args, scratch);
+    }
+    else if (args->output->data != args->source->data) {
+        copyImageRect(args->output, args->start_x, args->start_y, args->source, args->start_x, args->start_y,
+                      args->end_x - args->start_x, args->end_y - args->start_y);
+    }
+    if (args->yellow) {
         yellow_filter(args);
+    }
+    if (args->holes) {
         draw_holes(args);
     }
-    free(args);
-    pthread_exit(NULL);
+    releaseArena(scratch, mark);
 }
 
-void process_threads(struct Pixel** pixels, struct DIB_Header DIB, struct BMP_Header BMP, bool blur, bool cheese, int** random_coordinates, int* holes_array, int holes_total) {
-    pthread_t tids[THREAD_COUNT];
-    struct thread_info** threads = (struct thread_info**)malloc(sizeof(struct thread_info*)*THREAD_COUNT);
+void process_tiles(struct ThreadPool* pool, const struct filter_args* common) {
+    int side = tile_side();
+    int across = (common->source->width + side - 1) / side;
+    int down = (common->source->height + side - 1) / side;
+    struct filter_args* tiles = (struct filter_args*)allocArena(common->arena, sizeof(struct filter_args) * across * down);
+    if (!tiles) {
+        fprintf(stderr, "Error: Unable to allocate tiles.\n");
+        exit(EXIT_FAILURE);
+    }
 
-    int thread_width = (DIB.width / THREAD_COUNT);
+    // tiles are numbered row by row, so the block of tiles every worker starts with is a band of the image
+    for (int t = 0; t < across * down; t++) {
+        int start_x = t % across * side;
+        int start_y = t / across * side;
 
-    int padding = 0;
+        tiles[t] = *common;
+        set_region(&tiles[t], start_x, start_x + side < common->source->width ? start_x + side : common->source->width,
+                   start_y, start_y + side < common->source->height ? start_y + side : common->source->height);
+    }
+
+    if (distributeThreadPool(pool, apply_filters, tiles, sizeof(struct filter_args), across * down) != 0) {
+        for (int t = 0; t < across * down; t++) {
+            apply_filters(&tiles[t], pool->count);
+        }
+    }
+}
+
+void region_bounds(int size, int regions, int i, int* start, int* end) {
+    // every region gets the same share, the last one also takes what is left over by the division
+    int share = size / regions;
+    *start = share * i;
+    *end = i < regions - 1 ? *start + share : size;
+}
+
+void touch_band(void* arg, int worker) {
+    struct band_args* band = (struct band_args*)arg;
+    int planes = band->image->format == IMAGE_PLANAR ? 3 : 1;
+    (void)worker;
+
+    // the kernel puts a page on the node of the CPU that touches it first, zeroing the rows of the band on
+    // the worker that will filter them keeps them on its node
+    for (int p = 0; p < planes; p++) {
+        memset(imagePlaneRow(band->image, p, band->start_y), 0, (size_t)band->image->stride * (band->end_y - band->start_y));
+    }
+}
+
+void touch_image(struct ThreadPool* pool, struct Arena* arena, struct Image* image) {
+    struct band_args* bands = (struct band_args*)allocArena(arena, sizeof(struct band_args) * pool->count);
+    if (!bands) {
+        fprintf(stderr, "Error: Unable to allocate regions.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // the bands are the same ones process_threads gives to each worker
+    for (int i = 0; i < pool->count; i++) {
+        bands[i].image = image;
+        region_bounds(image->height, pool->count, i, &bands[i].start_y, &bands[i].end_y);
+        if (bands[i].start_y == bands[i].end_y) continue;
+
+        if (submitWorkerThreadPool(pool, i, touch_band, &bands[i]) != 0) {
+            touch_band(&bands[i], pool->count);
+        }
+    }
+
+    waitThreadPool(pool);
+}
+
+void balance_regions(const struct filter_args* common, bool rows, int regions, int* bounds) {
+    int lines = rows ? common->source->height : common->source->width;
+    int across = rows ? common->source->width : common->source->height;
+    long long* change = (long long*)allocArena(common->arena, sizeof(long long) * (lines + 1));
+    if (!change) {
+        fprintf(stderr, "Error: Unable to allocate regions.\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(change, 0, sizeof(long long) * (lines + 1));
+
+    // every hole adds the width of the box draw_holes visits to each line the box covers. the changes are only
+    // recorded where a box starts and ends, so the cost of a line is the running sum of them
+    change[0] = (long long)across * (common->blur ? COST_BLUR_PIXEL * common->iterations : COST_PIXEL);
+    for (int i = 0; i < common->holes_total; i++) {
+        int reach = (int)ceil(sqrt(hole_smoothing(common, i))) + 1;
+        int along = common->coordinates[i][rows ? 1 : 0];
+        int other = common->coordinates[i][rows ? 0 : 1];
+        int first = along - reach > 0 ? along - reach : 0;
+        int last = along + reach < lines ? along + reach + 1 : lines;
+        int width = (other + reach < across ? other + reach + 1 : across) - (other - reach > 0 ? other - reach : 0);
 
-    if (DIB.width % THREAD_COUNT != 0) {
-        padding = DIB.width % THREAD_COUNT;
+        if (first >= last || width <= 0) continue;
+        change[first] += (long long)width * COST_HOLE_PIXEL;
+        change[last] -= (long long)width * COST_HOLE_PIXEL;
     }
 
-    for (int i = 0; i < THREAD_COUNT; i++) {
-        threads[i] = (struct thread_info*)malloc(sizeof(struct thread_info));
-        threads[i]->start = 0;
-        threads[i]->end = i == THREAD_COUNT - 1 ? thread_width + padding : thread_width;
+    long long total = 0, line_cost = 0;
+    for (int line = 0; line < lines; line++) {
+        line_cost += change[line];
+        total += line_cost;
     }
 
-    struct Pixel*** tdata = (struct Pixel***)malloc(sizeof(struct Pixel**)*THREAD_COUNT);
+    // region k ends on the first line where the cost so far reaches k shares of the total
+    long long sum = 0;
+    int k = 1;
+    line_cost = 0;
+    bounds[0] = 0;
+    for (int line = 0; line < lines && k < regions; line++) {
+        line_cost += change[line];
+        sum += line_cost;
+        while (k < regions && sum * regions >= total * k) {
+            bounds[k++] = line + 1;
+        }
+    }
+    while (k <= regions) {
+        bounds[k++] = lines;
+    }
+}
+
+void gaussian_coefficients(double sigma, double* coefficients) {
+    // Young and van Vliet, "Recursive implementation of the Gaussian filter" (1995): a causal and an anticausal
+    // third order filter run over every line, q is fitted so that together they match the gaussian of sigma
+    double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * sqrt(1.0 - 0.26891 * sigma);
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    double b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+    double b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+    double b3 = 0.422205 * q * q * q;
 
-    int start = 0;
-    int end = thread_width;
+    coefficients[0] = 1.0 - (b1 + b2 + b3) / b0;
+    coefficients[1] = b1 / b0;
+    coefficients[2] = b2 / b0;
+    coefficients[3] = b3 / b0;
+}
 
-    for (int i = 0; i < THREAD_COUNT; i++) {
-        tdata[i] = (struct Pixel**)malloc(sizeof(struct Pixel*)*DIB.height);
-        for (int j = 0; j < DIB.height; j++) {
-            if (i == 0) { // cannot add extra column to the left so only adding extra to the right
-                tdata[i][j] = (struct Pixel*)malloc(sizeof(struct Pixel)*(end + 2));
+void gaussian_rows(void* arg, int worker) {
+    struct gaussian_args* args = (struct gaussian_args*)arg;
+    int width = args->source->width;
+    size_t plane = (size_t)width * args->source->height;
+    double B = args->coefficients[0], b1 = args->coefficients[1], b2 = args->coefficients[2], b3 = args->coefficients[3];
+    struct Image window;
+
+    // every row of the band is split into planes and filtered forwards and backwards on its own, the lines
+    // are started as if the row went on with its first and last value
+    void* block = allocArena(threadArena(args->arena, worker), imageBlockSize(width, 1, IMAGE_PLANAR));
+    if (!block) {
+        fprintf(stderr, "Error: Unable to allocate image.\n");
+        exit(EXIT_FAILURE);
+    }
+    layoutImage(&window, block, width, 1, IMAGE_PLANAR);
+
+    for (int h = args->start; h < args->end; h++) {
+        copyImageRect(&window, 0, 0, args->source, 0, h, width, 1);
+
+        for (int c = 0; c < 3; c++) {
+            const unsigned char* in = imagePlaneRow(&window, c, 0);
+            float* out = args->planes + plane * c + (size_t)width * h;
+            double w1 = in[0], w2 = in[0], w3 = in[0];
+
+            for (int x = 0; x < width; x++) {
+                double w0 = B * in[x] + b1 * w1 + b2 * w2 + b3 * w3;
+                out[x] = (float)w0;
+                w3 = w2;
+                w2 = w1;
+                w1 = w0;
             }
-            else if (i > 0 && i < THREAD_COUNT - 1) { // can add extra column to the left and extra to the right
-                tdata[i][j] = (struct Pixel*)malloc(sizeof(struct Pixel)*(end + 4));
+
+            w1 = w2 = w3 = out[width - 1];
+            for (int x = width - 1; x >= 0; x--) {
+                double w0 = B * out[x] + b1 * w1 + b2 * w2 + b3 * w3;
+                out[x] = (float)w0;
+                w3 = w2;
+                w2 = w1;
+                w1 = w0;
             }
-            else { // cannot add extra column to the right so only adding extra to the left and any extra columns to the right if division of threads not even
-                tdata[i][j] = (struct Pixel*)malloc(sizeof(struct Pixel)*(end + 2 + padding));
+        }
+    }
+}
+
+void gaussian_columns(void* arg, int worker) {
+    struct gaussian_args* args = (struct gaussian_args*)arg;
+    int width = args->source->width;
+    int height = args->source->height;
+    int count = args->end - args->start;
+    int step = channelStep(args->output->format);
+    size_t plane = (size_t)width * height;
+    double B = args->coefficients[0], b1 = args->coefficients[1], b2 = args->coefficients[2], b3 = args->coefficients[3];
+    double w1[GAUSSIAN_BLOCK], w2[GAUSSIAN_BLOCK], w3[GAUSSIAN_BLOCK];
+    (void)worker;
+
+    // the columns of the block run down and back up together, so every step reads one short run of each row
+    // and the filter state of all columns stays in registers and the L1 cache
+    for (int c = 0; c < 3; c++) {
+        float* first = args->planes + plane * c + args->start;
+
+        for (int x = 0; x < count; x++) {
+            w1[x] = w2[x] = w3[x] = first[x];
+        }
+        for (int h = 0; h < height; h++) {
+            float* row = first + (size_t)width * h;
+            for (int x = 0; x < count; x++) {
+                double w0 = B * row[x] + b1 * w1[x] + b2 * w2[x] + b3 * w3[x];
+                row[x] = (float)w0;
+                w3[x] = w2[x];
+                w2[x] = w1[x];
+                w1[x] = w0;
+            }
+        }
+
+        for (int x = 0; x < count; x++) {
+            w1[x] = w2[x] = w3[x] = first[(size_t)width * (height - 1) + x];
+        }
+        for (int h = height - 1; h >= 0; h--) {
+            const float* row = first + (size_t)width * h;
+            unsigned char* out = imageChannel(args->output, c, args->start, h);
+            for (int x = 0; x < count; x++) {
+                double w0 = B * row[x] + b1 * w1[x] + b2 * w2[x] + b3 * w3[x];
+                out[x * step] = (unsigned char)(w0 <= 0.0 ? 0 : w0 >= 255.0 ? 255 : (int)(w0 + 0.5));
+                w3[x] = w2[x];
+                w2[x] = w1[x];
+                w1[x] = w0;
             }
         }
     }
+}
 
-    for (int i = 0; i < THREAD_COUNT; i++) {
-        for (int h = 0; h < DIB.height; h++) {
-            if (i == 0) {
-                for (int w = start; w < end + 2; w++) {
-                    tdata[i][h][w - start] = pixels[h][w];
-                }
+void gaussian_filter(struct ThreadPool* pool, struct Arena* arena, const struct Image* pixels, struct Image* output, double sigma) {
+    struct gaussian_args common;
+    int blocks = (pixels->width + GAUSSIAN_BLOCK - 1) / GAUSSIAN_BLOCK;
+    struct gaussian_args* bands = (struct gaussian_args*)allocArena(arena, sizeof(struct gaussian_args) * pool->count);
+    struct gaussian_args* strips = (struct gaussian_args*)allocArena(arena, sizeof(struct gaussian_args) * blocks);
+
+    common.source = pixels;
+    common.output = output;
+    common.planes = (float*)allocArena(arena, sizeof(float) * 3 * (size_t)pixels->width * pixels->height);
+    common.arena = arena;
+    gaussian_coefficients(sigma, common.coefficients);
+    if (!bands || !strips || !common.planes) {
+        fprintf(stderr, "Error: Unable to allocate image.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // the horizontal pass gives every worker a band of rows. the vertical pass needs every row of it, so it
+    // only starts once the whole image went through the horizontal one
+    for (int i = 0; i < pool->count; i++) {
+        bands[i] = common;
+        region_bounds(pixels->height, pool->count, i, &bands[i].start, &bands[i].end);
+        if (bands[i].start == bands[i].end) continue;
+
+        if (submitThreadPool(pool, gaussian_rows, &bands[i]) != 0) {
+            gaussian_rows(&bands[i], pool->count);
+        }
+    }
+    waitThreadPool(pool);
+
+    // the vertical pass works on blocks of columns, shared out by work stealing
+    for (int b = 0; b < blocks; b++) {
+        strips[b] = common;
+        strips[b].start = b * GAUSSIAN_BLOCK;
+        strips[b].end = strips[b].start + GAUSSIAN_BLOCK < pixels->width ? strips[b].start + GAUSSIAN_BLOCK : pixels->width;
+    }
+    if (distributeThreadPool(pool, gaussian_columns, strips, sizeof(struct gaussian_args), blocks) != 0) {
+        for (int b = 0; b < blocks; b++) {
+            gaussian_columns(&strips[b], pool->count);
+        }
+    }
+}
+
+void process_threads(struct ThreadPool* pool, struct Arena* arena, struct Image* pixels, struct Image* output, const struct filter_options* options, int** random_coordinates, int* holes_array, int holes_total) {
+    struct filter_args common;
+
+    common.source = pixels;
+    common.output = output;
+    common.window = options->layout;
+    common.coordinates = random_coordinates;
+    common.radii = holes_array;
+    common.holes_total = holes_total;
+    common.blur = options->blur;
+    // indexed images had their palette filtered already
+    common.yellow = (options->yellow || options->cheese) && pixels->format != IMAGE_INDEXED8;
+    common.holes = options->cheese;
+    common.in_place = options->in_place;
+    common.radius = options->radius;
+    common.iterations = options->iterations;
+    common.kernels = options->kernels;
+    common.arena = arena;
+
+    // the gaussian blur runs over the whole image before the regions, which then work on its result
+    if (options->gaussian) {
+        gaussian_filter(pool, arena, pixels, output, options->sigma);
+        common.source = output;
+    }
+
+    if (options->partition == PARTITION_TILES) {
+        process_tiles(pool, &common);
+        return;
+    }
+
+    int regions = pool->count;
+    struct filter_args* tasks = (struct filter_args*)allocArena(arena, sizeof(struct filter_args) * regions);
+    if (!tasks) {
+        fprintf(stderr, "Error: Unable to allocate regions.\n");
+        exit(EXIT_FAILURE);
+    }
+    bool rows = options->partition == PARTITION_ROWS;
+    int* bounds = (int*)allocArena(arena, sizeof(int) * (regions + 1));
+    if (!bounds) {
+        fprintf(stderr, "Error: Unable to allocate regions.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // the regions are bands of rows or strips of columns, one per worker. bands keep every row of the image in
+    // one piece, strips cut every row into one short piece per worker. holes make some regions much more work
+    // than others, so with holes the regions get equal shares of the estimated cost instead of equal sizes.
+    // NUMA bands were placed before the holes were known and keep their size
+    if (common.holes && options->balance && !options->numa) {
+        balance_regions(&common, rows, regions, bounds);
+    }
+    else {
+        for (int i = 0; i < regions; i++) {
+            region_bounds(rows ? pixels->height : pixels->width, regions, i, &bounds[i], &bounds[i + 1]);
+        }
+    }
+
+    for (int i = 0; i < regions; i++) {
+        struct filter_args* args = &tasks[i];
+        int start = bounds[i];
+        int end = bounds[i + 1];
+
+        *args = common;
+        if (rows) {
+            set_region(args, 0, pixels->width, start, end);
+        }
+        else {
+            set_region(args, start, end, 0, pixels->height);
+        }
+
+        // images smaller than the number of workers in the cut direction leave some regions empty
+        if (start == end) continue;
+
+        // in NUMA mode band i was first touched by worker i, so it has to run there as well
+        if ((options->numa ? submitWorkerThreadPool(pool, i, apply_filters, args) : submitThreadPool(pool, apply_filters, args)) != 0) {
+            apply_filters(args, pool->count);
+        }
+    }
+
+    waitThreadPool(pool);
+}
+
+bool needs_truecolor(const struct filter_options* options) {
+    // blur mixes neighbouring colors and holes fade pixels towards black, neither result is in the palette
+    return options->blur || options->gaussian || options->cheese;
+}
+
+bool needs_result_image(const struct Image* pixels, const struct filter_options* options) {
+    // the blur of a region reads the original pixels next to it, so it can never write over its own source.
+    // indexed images also need somewhere to put their real colors
+    return options->blur || options->gaussian || (pixels->format == IMAGE_INDEXED8 && needs_truecolor(options));
+}
+
+void filter_image(struct ThreadPool* pool, struct Arena* arena, struct Image* pixels, struct Image* output, const struct filter_options* options) {
+    if (pixels->format == IMAGE_INDEXED8) {
+        if (options->yellow || options->cheese) {
+            yellow_palette_filter(pixels->palette);
+        }
+        if (output->format == IMAGE_INDEXED8) {
+            if (output != pixels) {
+                memcpy(output->palette, pixels->palette, sizeof(struct Pixel32) * IMAGE_PALETTE_SIZE);
+                copyImageRect(output, 0, 0, pixels, 0, 0, pixels->width, pixels->height);
             }
-            else if (i > 0 && i < THREAD_COUNT - 1) {
-                for (int w = start; w < end + 4; w++) {
-                    tdata[i][h][w - start] = pixels[h][w - 2];
-                }
+            return;
+        }
+    }
+
+    int holes_total = (int) fmin((double) pixels->width, (double) pixels->height) * 0.08;
+
+    if (holes_total == 0) holes_total++;
+
+    int* holes_array;
+    holes_array = calculate_holes(arena, pixels, pixels->height, pixels->width, holes_total);
+
+    int** random_coordinates;
+    random_coordinates = calculate_random_coordinates(arena, pixels->height, pixels->width, holes_total);
+
+    process_threads(pool, arena, pixels, output, options, random_coordinates, holes_array, holes_total);
+}
+
+void report_pages(const char* file, const char* name, const struct Image* image) {
+    // views of files and buffers are never backed by huge pages, only images the program allocated
+    if (!image->block) return;
+
+    // mapped blocks are rounded up to whole huge pages
+    size_t size = image->block_size > 0 ? image->block_size : (size_t)image->stride * image->height * (image->format == IMAGE_PLANAR ? 3 : 1);
+    if (image->pages == IMAGE_PAGES_SMALL) {
+        printf("%s: %s %zu KB, below the huge page threshold\n", file, name, size / 1024);
+    }
+    else {
+        printf("%s: %s %zu KB, %zu KB in %s huge pages\n", file, name, size / 1024, hugePagesImage(image) / 1024,
+               image->pages == IMAGE_PAGES_HUGETLB ? "hugetlbfs" : "transparent");
+    }
+}
+
+void process_file(struct ThreadPool* pool, struct Arena* arena, const char* inputFile, const char* outputFile, enum io_mode mode, const struct filter_options* options) {
+    struct BMP_Header BMP;
+    struct DIB_Header DIB;
+
+    FILE *file_input = fopen(inputFile, "r");
+    if (!file_input) {
+        fprintf(stderr, "Error: Unable to open input file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // inputs are told apart by their contents, outputs by their extension
+    bool qoi_input = isQOIFile(file_input);
+    bool qoi_output = isQOIPath(outputFile);
+    struct Image pixels;
+
+    if (qoi_input) {
+        struct QOI_Header QOI;
+        if (readQOI(file_input, &QOI, &pixels) != 0) {
+            fprintf(stderr, "Error: Unable to read input file. Only complete 3 and 4 channel QOI images are supported.\n");
+            exit(EXIT_FAILURE);
+        }
+        // QOI files have no row order to keep, BMP files made from them are bottom-up like most BMP files
+        makeHeadersBMP(&BMP, &DIB, NULL, pixels.width, pixels.height, 24);
+    }
+    else {
+        readBMPHeader(file_input, &BMP);
+        readDIBHeader(file_input, &DIB);
+
+        if (!isSupportedBMP(&BMP, &DIB)) {
+            fprintf(stderr, "Error: Unsupported BMP format in input file. Only uncompressed 8, 24 and 32 bit images are supported.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // writing the output over the input would truncate the file underneath the mapping
+    struct stat in_stat, out_stat;
+    bool same_file = fstat(fileno(file_input), &in_stat) == 0 && stat(outputFile, &out_stat) == 0 &&
+                     in_stat.st_dev == out_stat.st_dev && in_stat.st_ino == out_stat.st_ino;
+
+    struct BMP_Mapping mapping;
+    // pages of a mapped file were placed by whoever read the file, so NUMA mode reads into its own bands
+    bool mapped = !qoi_input && mode == IO_MMAP && !same_file && !options->numa && mapPixelsBMP(file_input, &BMP, &DIB, &mapping) == 0;
+
+    if (mapped) {
+        pixels = mapping.image;
+    }
+    else if (!qoi_input) {
+        // 8 bit images stay indexed so color filters only touch the palette
+        if (allocImage(&pixels, DIB.width, abs(DIB.height), DIB.bitsPerPixel == 8 ? IMAGE_INDEXED8 : options->layout) != 0) {
+            fprintf(stderr, "Error: Unable to allocate image.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (options->numa) {
+            touch_image(pool, arena, &pixels);
+        }
+        if (mode == IO_PARALLEL) {
+            if (readPixelsBMPParallel(fileno(file_input), &BMP, &DIB, &pixels, pool) != 0) {
+                fprintf(stderr, "Error: Unable to read input file.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (readPixelsBMP(file_input, &BMP, &DIB, &pixels) != 0) {
+            fprintf(stderr, "Error: Unable to read input file.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    fclose(file_input);
+
+    // in mmap mode the workers store their regions straight into the output file, otherwise back into pixels
+    // or, when pixels has to stay untouched, into a result image.
+    // the output keeps the row order of the input so top-down images are never reversed. indexed images
+    // are only written as 8 bit files when no filter needs the real colors
+    int output_bits = pixels.format == IMAGE_INDEXED8 && !needs_truecolor(options) ? 8 : 24;
+    struct BMP_Mapping output_mapping;
+    bool output_mapped = !qoi_output && mode == IO_MMAP && createMappedBMP(outputFile, &output_mapping, &DIB, DIB.width, DIB.height, output_bits) == 0;
+    struct Image result = pixels;
+
+    if (!output_mapped && needs_result_image(&pixels, options)) {
+        if (allocImage(&result, pixels.width, pixels.height, options->layout) != 0) {
+            fprintf(stderr, "Error: Unable to allocate image.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (options->numa) {
+            touch_image(pool, arena, &result);
+        }
+    }
+
+    filter_image(pool, arena, &pixels, output_mapped ? &output_mapping.image : &result, options);
+
+    if (options->verbose) {
+        report_pages(inputFile, "pixels", &pixels);
+        if (result.data != pixels.data) {
+            report_pages(inputFile, "result", &result);
+        }
+    }
+
+    if (output_mapped) {
+        unmapPixelsBMP(&output_mapping);
+    }
+    else {
+        FILE *file_output = fopen(outputFile, "wb");
+        if (!file_output) {
+            fprintf(stderr, "Error: Unable to open output file.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (qoi_output) {
+            if (writeQOI(file_output, &result, pool) != 0) {
+                fprintf(stderr, "Error: Unable to write output file.\n");
+                exit(EXIT_FAILURE);
             }
-            else {
-                for (int w = start; w < end + 2 + padding ; w++) {
-                    tdata[i][h][w - start] = pixels[h][w - 2];
+        }
+        else {
+            struct BMP_Header output_BMP;
+            struct DIB_Header output_DIB;
+            makeHeadersBMP(&output_BMP, &output_DIB, &DIB, DIB.width, DIB.height, output_bits);
+
+            writeBMPHeader(file_output, &output_BMP);
+            writeDIBHeader(file_output, &output_DIB);
+            if (mode == IO_PARALLEL) {
+                fflush(file_output);
+                if (writePixelsBMPParallel(fileno(file_output), &output_BMP, &output_DIB, &result, pool) != 0) {
+                    fprintf(stderr, "Error: Unable to write output file.\n");
+                    exit(EXIT_FAILURE);
                 }
             }
+            else if (writePixelsBMP(file_output, &output_DIB, &result) != 0) {
+                fprintf(stderr, "Error: Unable to write output file.\n");
+                exit(EXIT_FAILURE);
+            }
         }
-        start += thread_width;
-        end += thread_width;
-        threads[i]->data = tdata[i];
+        fclose(file_output);
     }
-    start = 0;
-    end = thread_width;
 
-    for (int i = 0; i < THREAD_COUNT; i++) {
-        struct filter_args* args = (struct filter_args*)malloc(sizeof(struct filter_args));
-        args->pArr = tdata[i];
-        args->width = i == 0 ? thread_width + 2 : i > 0 && i < THREAD_COUNT - 1 ? thread_width + 4 : thread_width + 2 + padding;
-        args->height = DIB.height;
-        args->start_x = i == 0 ? start : start - 2;
-        args->end_x = i == 0 ? end + 2 : i < THREAD_COUNT - 1 ? end + 2 : end + padding;
-        args->coordinates = random_coordinates;
-        args->radii = holes_array;
-        args->holes_total = holes_total;
-        args->blur = blur;
-        args->cheese = cheese;
-        pthread_create(&tids[i], NULL, apply_filters, args);
+    if (result.data != pixels.data) {
+        freeImage(&result);
+    }
 
-        start += thread_width;
-        end += thread_width;
+    if (mapped) {
+        unmapPixelsBMP(&mapping);
+    }
+    else {
+        freeImage(&pixels);
     }
+}
 
-    for (int i = 0; i < THREAD_COUNT; i++) {
-        pthread_join(tids[i], NULL);
+void submit_read(struct AsyncIO* io, struct batch_item* item, const char* inputFile) {
+    struct stat in_stat;
+
+    item->in_fd = open(inputFile, O_RDONLY);
+    if (item->in_fd < 0 || fstat(item->in_fd, &in_stat) != 0) {
+        fprintf(stderr, "Error: Unable to open input file %s.\n", inputFile);
+        exit(EXIT_FAILURE);
     }
 
-    for (int i = 0; i < THREAD_COUNT; i++) {
-        start = i * thread_width;
-        end = start + thread_width;
+    item->input = malloc(in_stat.st_size > 0 ? (size_t)in_stat.st_size : 1);
+    if (!item->input) {
+        fprintf(stderr, "Error: Unable to allocate image.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    item->read.fd = item->in_fd;
+    item->read.buffer = item->input;
+    item->read.length = (size_t)in_stat.st_size;
+    item->read.offset = 0;
+    item->read.write = false;
+    submitAsyncIO(io, &item->read);
+}
+
+void finish_write(struct AsyncIO* io, struct batch_item* item, const char* outputFile) {
+    if (waitAsyncIO(io, &item->write) != 0) {
+        fprintf(stderr, "Error: Unable to write output file %s.\n", outputFile);
+        exit(EXIT_FAILURE);
+    }
+    close(item->out_fd);
+    free(item->output.base);
+    item->output.base = NULL;
+}
 
-        if (i == THREAD_COUNT - 1) end = DIB.width;
+void process_batch_async(struct ThreadPool* pool, struct Arena* arena, char** inputFiles, char** outputFiles, int count, const struct filter_options* options) {
+    struct AsyncIO io;
+    initAsyncIO(&io, 2 * (READ_AHEAD + 1));
 
-        for (int h = 0; h < DIB.height; h++) {
-            // have to account for extra columns added to the right of the first thread to blend pixels. need to write back into pixels normally since no left pad columns
-            if (i == 0) {
-                for (int w = start; w < end; w++) {
-                    pixels[h][w] = tdata[i][h][w - start];
+    struct batch_item* items = (struct batch_item*)calloc(count, sizeof(struct batch_item));
+
+    // keep READ_AHEAD reads queued in front of the image being filtered
+    for (int k = 0; k < count && k < READ_AHEAD; k++) {
+        submit_read(&io, &items[k], inputFiles[k]);
+    }
+
+    for (int k = 0; k < count; k++) {
+        struct batch_item* item = &items[k];
+        struct BMP_Header BMP;
+        struct DIB_Header DIB;
+        struct QOI_Header QOI;
+        struct BMP_Mapping mapping;
+        struct Image pixels;
+
+        if (k + READ_AHEAD < count) {
+            submit_read(&io, &items[k + READ_AHEAD], inputFiles[k + READ_AHEAD]);
+        }
+
+        bool read = waitAsyncIO(&io, &item->read) == 0;
+        bool qoi_input = read && isQOIData(item->input, item->read.length);
+
+        if (!read || (qoi_input ? decodeQOI(item->input, item->read.length, &QOI, &pixels)
+                                : openBufferBMP(&mapping, item->input, item->read.length, &BMP, &DIB)) != 0) {
+            fprintf(stderr, "Error: Unable to read input file %s.\n", inputFiles[k]);
+            exit(EXIT_FAILURE);
+        }
+        close(item->in_fd);
+        if (qoi_input) {
+            makeHeadersBMP(&BMP, &DIB, NULL, pixels.width, pixels.height, 24);
+        }
+        else {
+            pixels = mapping.image;
+        }
+
+        if (isQOIPath(outputFiles[k])) {
+            // the input buffer is ours, so the image is filtered where it is and encoded from there
+            // unless it is blurred or indexes have to become real colors
+            struct Image result = pixels;
+            if (needs_result_image(&pixels, options)) {
+                if (allocImage(&result, pixels.width, pixels.height, options->layout) != 0) {
+                    fprintf(stderr, "Error: Unable to allocate image.\n");
+                    exit(EXIT_FAILURE);
                 }
-            }
-            // have to account for extra columns added to the left and right middle threads to blend pixels. need to write back into pixels starting at index 2 of tdata to write correct pixels
-            else if (i > 0 && i < THREAD_COUNT - 1) {
-                for (int w = start; w < end + 2; w++) {
-                    pixels[h][w] = tdata[i][h][w - start + 2];
+                if (options->numa) {
+                    touch_image(pool, arena, &result);
                 }
             }
-            // have to account for extra columns added to the left of the last thread to blend pixels. need to write back into pixels starting at index 2 of tdata to write correct pixels
-            else {
-                for (int w = start; w < DIB.width; w++) {
-                    pixels[h][w] = tdata[i][h][w - start + 2];
+
+            filter_image(pool, arena, &pixels, &result, options);
+            if (options->verbose) {
+                report_pages(inputFiles[k], "pixels", &pixels);
+                if (result.data != pixels.data) {
+                    report_pages(inputFiles[k], "result", &result);
                 }
             }
+            if (encodeQOI(&result, pool, &item->output.base, &item->output.length) != 0) {
+                fprintf(stderr, "Error: Unable to allocate image.\n");
+                exit(EXIT_FAILURE);
+            }
+            if (result.data != pixels.data) {
+                freeImage(&result);
+            }
+        }
+        else {
+            // the workers store their regions straight into a buffer laid out like the output file
+            int output_bits = pixels.format == IMAGE_INDEXED8 && !needs_truecolor(options) ? 8 : 24;
+            if (createBufferBMP(&item->output, &DIB, DIB.width, DIB.height, output_bits) != 0) {
+                fprintf(stderr, "Error: Unable to allocate image.\n");
+                exit(EXIT_FAILURE);
+            }
+
+            filter_image(pool, arena, &pixels, &item->output.image, options);
+            if (options->verbose) {
+                report_pages(inputFiles[k], "pixels", &pixels);
+            }
+        }
+        if (qoi_input) {
+            freeImage(&pixels);
+        }
+        free(item->input);
+        item->input = NULL;
+        resetArena(arena);
+
+        // bound the number of output buffers waiting to be written
+        if (k >= READ_AHEAD) {
+            finish_write(&io, &items[k - READ_AHEAD], outputFiles[k - READ_AHEAD]);
         }
-    }
 
-    for (int i = 0; i < THREAD_COUNT; i++) {
-        for (int h = 0; h < DIB.height; h++) {
-            free(tdata[i][h]);
+        item->out_fd = open(outputFiles[k], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (item->out_fd < 0) {
+            fprintf(stderr, "Error: Unable to open output file %s.\n", outputFiles[k]);
+            exit(EXIT_FAILURE);
         }
-        free(tdata[i]);
-        free(threads[i]);
+        item->write.fd = item->out_fd;
+        item->write.buffer = item->output.base;
+        item->write.length = item->output.length;
+        item->write.offset = 0;
+        item->write.write = true;
+        submitAsyncIO(&io, &item->write);
     }
-    free(threads);
-    free(tdata);
+
+    for (int k = count > READ_AHEAD ? count - READ_AHEAD : 0; k < count; k++) {
+        finish_write(&io, &items[k], outputFiles[k]);
+    }
+
+    closeAsyncIO(&io);
+    free(items);
 }
 
 int main(int argc, char *argv[]) {
     int option;
-    char *inputFile = NULL;
-    char *outputFile = NULL;
-    bool blur = false;
-    bool cheese = false;
-
-    if (argc != 7) {
-        fprintf(stderr, "Usage: %s -i <input file> -o <output file> -f <filter>\n", argv[0]);
-        return 1;
-    }
+    char **inputFiles = (char **) malloc(sizeof(char *) * argc);
+    char **outputFiles = (char **) malloc(sizeof(char *) * argc);
+    int input_count = 0;
+    int output_count = 0;
+    char *filters = NULL;
+    struct filter_options options = {false, 1, 1, NULL, false, GAUSSIAN_SIGMA, false, false, IMAGE_BGRX32, PARTITION_ROWS, false, false, true, false};
+    enum io_mode mode = IO_MMAP;
+    int threads = 0;
+    bool pin = false;
+    const char* kernels = NULL;
 
-    while ((option = getopt(argc, argv, "i:o:f:")) != -1) {
+    while ((option = getopt(argc, argv, "i:o:f:m:l:p:t:aNvEB:s:n:")) != -1) {
         switch (option) {
             case 'i':
-                inputFile = optarg;
+                inputFiles[input_count++] = optarg;
                 break;
             case 'o':
-                outputFile = optarg;
+                outputFiles[output_count++] = optarg;
                 break;
             case 'f':
+                filters = optarg;
                 for (int i = 0; optarg[i] != '\0'; i++) {
                     if (optarg[i] == 'b') {
-                        blur = true;
+                        options.blur = true;
+                        // digits right after the b give the radius of the blur box
+                        if (isdigit((unsigned char)optarg[i + 1])) {
+                            char* end;
+                            long radius = strtol(&optarg[i + 1], &end, 10);
+                            if (radius < 1 || radius > MAX_BLUR_RADIUS) {
+                                fprintf(stderr, "Invalid blur radius. Use a radius from 1 to %d, e.g. 'b3'.\n", MAX_BLUR_RADIUS);
+                                return 1;
+                            }
+                            options.radius = (int)radius;
+                            i = (int)(end - optarg) - 1;
+                        }
+                    } else if (optarg[i] == 'g') {
+                        options.gaussian = true;
+                        // a number right after the g gives the sigma of the gaussian
+                        if (isdigit((unsigned char)optarg[i + 1]) || optarg[i + 1] == '.') {
+                            char* end;
+                            options.sigma = strtod(&optarg[i + 1], &end);
+                            i = (int)(end - optarg) - 1;
+                        }
+                        if (options.sigma < MIN_GAUSSIAN_SIGMA || options.sigma > MAX_GAUSSIAN_SIGMA) {
+                            fprintf(stderr, "Invalid gaussian sigma. Use a sigma from %.1f to %.1f, e.g. 'g2.5'.\n", MIN_GAUSSIAN_SIGMA, MAX_GAUSSIAN_SIGMA);
+                            return 1;
+                        }
                     } else if (optarg[i] == 'c') {
-                        cheese = true;
+                        options.cheese = true;
+                    } else if (optarg[i] == 'y') {
+                        options.yellow = true;
                     } else {
-                        fprintf(stderr, "Invalid filter. Use 'b' for blur filter and 'c' for cheese filter.\n");
+                        fprintf(stderr, "Invalid filter. Use 'b' for blur filter, 'g' for gaussian blur filter, 'c' for cheese filter and 'y' for yellow filter.\n");
                         return 1;
                     }
                 }
                 break;
+            case 'm':
+                if (strcmp(optarg, "mmap") == 0) {
+                    mode = IO_MMAP;
+                } else if (strcmp(optarg, "stdio") == 0) {
+                    mode = IO_STDIO;
+                } else if (strcmp(optarg, "parallel") == 0) {
+                    mode = IO_PARALLEL;
+                } else if (strcmp(optarg, "async") == 0) {
+                    mode = IO_ASYNC;
+                } else {
+                    fprintf(stderr, "Invalid I/O mode. Use 'mmap', 'stdio', 'parallel' or 'async'.\n");
+                    return 1;
+                }
+                break;
+            case 'l':
+                if (strcmp(optarg, "interleaved") == 0) {
+                    options.layout = IMAGE_BGRX32;
+                } else if (strcmp(optarg, "planar") == 0) {
+                    options.layout = IMAGE_PLANAR;
+                } else {
+                    fprintf(stderr, "Invalid layout. Use 'interleaved' or 'planar'.\n");
+                    return 1;
+                }
+                break;
+            case 'p':
+                if (strcmp(optarg, "rows") == 0) {
+                    options.partition = PARTITION_ROWS;
+                } else if (strcmp(optarg, "cols") == 0) {
+                    options.partition = PARTITION_COLS;
+                } else if (strcmp(optarg, "tiles") == 0) {
+                    options.partition = PARTITION_TILES;
+                } else {
+                    fprintf(stderr, "Invalid partition. Use 'rows', 'cols' or 'tiles'.\n");
+                    return 1;
+                }
+                break;
+            case 't':
+                if (strcmp(optarg, "auto") == 0) {
+                    threads = 0;
+                } else if ((threads = atoi(optarg)) <= 0) {
+                    fprintf(stderr, "Invalid thread count. Use a number of threads or 'auto'.\n");
+                    return 1;
+                }
+                break;
+            case 'a':
+                pin = true;
+                break;
+            case 'N':
+                options.numa = true;
+                break;
+            case 'v':
+                options.verbose = true;
+                break;
+            case 'E':
+                options.balance = false;
+                break;
+            case 'B':
+                if (strcmp(optarg, "pingpong") == 0) {
+                    options.in_place = false;
+                } else if (strcmp(optarg, "inplace") == 0) {
+                    options.in_place = true;
+                } else {
+                    fprintf(stderr, "Invalid blur buffering. Use 'pingpong' or 'inplace'.\n");
+                    return 1;
+                }
+                break;
+            case 's':
+                kernels = optarg;
+                break;
+            case 'n':
+                if ((options.iterations = atoi(optarg)) <= 0) {
+                    fprintf(stderr, "Invalid iteration count. Use a number of blur iterations of at least 1.\n");
+                    return 1;
+                }
+                break;
             case '?':
             default:
-                fprintf(stderr, "Usage: %s -i <input file> -o <output file> -f <filter>\n", argv[0]);
+                fprintf(stderr, USAGE, argv[0]);
                 return 1;
         }
     }
 
-    struct BMP_Header BMP;
-    struct DIB_Header DIB;
-
-    FILE *file_input = fopen(inputFile, "r");
-    if (!file_input) {
-        fprintf(stderr, "Error: Unable to open input file.\n");
-        exit(EXIT_FAILURE);
+    if (input_count == 0 || input_count != output_count || !filters || optind != argc) {
+        fprintf(stderr, USAGE, argv[0]);
+        return 1;
     }
-    readBMPHeader(file_input, &BMP);
-    readDIBHeader(file_input, &DIB);
-
-    struct Pixel **pixels = (struct Pixel **) malloc(sizeof(struct Pixel *) * DIB.height);
-    for (int p = 0; p < DIB.height; p++) {
-        pixels[p] = (struct Pixel *) malloc(sizeof(struct Pixel) * DIB.width);
+    // the blur kernels are picked once for the whole run, from what the CPU supports
+    if (!(options.kernels = selectBlurKernels(kernels))) {
+        fprintf(stderr, "Invalid blur kernels. Use 'scalar', 'sse2', 'avx2' or 'avx512', as far as the CPU supports them.\n");
+        return 1;
+    }
+    if (options.verbose) {
+        printf("blur kernels: %s\n", options.kernels->name);
+    }
+    if (options.blur && options.gaussian) {
+        fprintf(stderr, "Invalid filter. Use either 'b' or 'g' to blur.\n");
+        return 1;
+    }
+    if (options.in_place && options.radius != 1) {
+        fprintf(stderr, "Invalid blur radius. In place blurring only works with radius 1.\n");
+        return 1;
+    }
+    if (options.in_place && options.iterations != 1) {
+        fprintf(stderr, "Invalid iteration count. In place blurring only works with one iteration.\n");
+        return 1;
+    }
+    if (options.numa && options.partition != PARTITION_ROWS) {
+        fprintf(stderr, "Invalid partition. NUMA placement only works with 'rows'.\n");
+        return 1;
     }
 
-    readPixelsBMP(file_input, pixels, DIB.width, DIB.height);
-    fclose(file_input);
-
-    int holes_total = (int) fmin((double) DIB.width, (double) DIB.height) * 0.08;
-
-    if (holes_total == 0) holes_total++;
-
-    int* holes_array;
-    holes_array = calculate_holes(pixels, DIB.height, DIB.width, holes_total);
-
-    int** random_coordinates;
-    random_coordinates = calculate_random_coordinates(DIB.height, DIB.width, holes_total);
-
-    process_threads(pixels, DIB, BMP, blur, cheese, random_coordinates, holes_array, holes_total);
-
-    FILE *file_output = fopen(outputFile, "wb");
-    writeBMPHeader(file_output, &BMP);
-    writeDIBHeader(file_output, &DIB);
-    writePixelsBMP(file_output, pixels, DIB.width, DIB.height);
-    fclose(file_output);
+    // the workers live for the whole run, so every image only queues its regions. by default there is one worker
+    // for every CPU the process is allowed to use
+    struct ThreadPool pool;
+    if (initThreadPool(&pool, threads > 0 ? threads : countCPUs()) != 0) {
+        fprintf(stderr, "Error: Unable to start worker threads.\n");
+        return 1;
+    }
+    // NUMA mode keeps every worker on one node, pinned to one of its CPUs or free to move between them
+    if (options.numa ? bindNodesThreadPool(&pool, pin) != 0 : pin && pinThreadPool(&pool) != 0) {
+        fprintf(stderr, "Error: Unable to pin worker threads to CPUs.\n");
+        closeThreadPool(&pool);
+        return 1;
+    }
 
-    for (int i = 0; i < holes_total; i++) {
-        free(random_coordinates[i]);
+    // everything that only lives while one image is filtered comes from the arena, which is reset after every
+    // image. the last sub-arena belongs to this thread for tasks it has to run itself
+    struct Arena arena;
+    if (initArena(&arena, 0, pool.count + 1) != 0) {
+        fprintf(stderr, "Error: Unable to allocate arena.\n");
+        closeThreadPool(&pool);
+        return 1;
     }
-    free(random_coordinates);
-    free(holes_array);
 
-    for (int i = 0; i < DIB.height; i++) {
-        free(pixels[i]);
+    if (mode == IO_ASYNC) {
+        process_batch_async(&pool, &arena, inputFiles, outputFiles, input_count, &options);
+    }
+    else {
+        for (int k = 0; k < input_count; k++) {
+            process_file(&pool, &arena, inputFiles[k], outputFiles[k], mode, &options);
+            resetArena(&arena);
+        }
     }
-    free(pixels);
+
+    freeArena(&arena);
+    closeThreadPool(&pool);
+
+    free(inputFiles);
+    free(outputFiles);
 
     return 0;
 }
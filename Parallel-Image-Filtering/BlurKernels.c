@@ -0,0 +1,345 @@
+/**
+* Implementation of the box blur kernels and of picking them for the CPU.
+*
+* @author Borys Banaszkiewicz
+* @version 1.0
+*/
+
+#include "BlurKernels.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLUR_HAVE_X86 1
+#endif
+
+/**
+ * Sum every channel of a row over the boxes around each pixel, one pixel at a
+ * time. One pixel enters the box on the right and one leaves it on the left,
+ * so the cost of a pixel does not depend on the radius. Only the first and
+ * last radius pixels test whether their box is cut off by the end of the row.
+ *
+ * @param  row: First byte of the row
+ * @param  sums: Destination, one sum for every byte of the row
+ * @param  width: Width of the row in pixels
+ * @param  channels: Bytes of one pixel
+ * @param  radius: Radius of the box
+ */
+static void sumsScalar(const unsigned char* row, unsigned int* sums, int width, int channels, int radius) {
+    int left = radius < width ? radius : width;
+    int right = width - radius > left ? width - radius : left;
+
+    for (int c = 0; c < channels; c++) {
+        unsigned int sum = 0;
+        int w = 0;
+
+        for (int x = 0; x < left; x++) {
+            sum += row[x * channels + c];
+        }
+        for (; w < left; w++) {
+            if (w + radius < width) sum += row[(w + radius) * channels + c];
+            sums[w * channels + c] = sum;
+        }
+        for (; w < right; w++) {
+            sum += row[(w + radius) * channels + c];
+            sums[w * channels + c] = sum;
+            sum -= row[(w - radius) * channels + c];
+        }
+        for (; w < width; w++) {
+            if (w + radius < width) sum += row[(w + radius) * channels + c];
+            sums[w * channels + c] = sum;
+            if (w - radius >= 0) sum -= row[(w - radius) * channels + c];
+        }
+    }
+}
+
+/**
+ * Average of the box of sum i near the edge, divided by its own number of pixels.
+ */
+static inline unsigned int divideScalar(unsigned int total, const struct BlurDivisor* divisor, int i) {
+    return total / (divisor->rows * divisor->across[i]);
+}
+
+/**
+ * Average of a box inside the row, the division by the constant is a multiply and a shift.
+ */
+static inline unsigned int reciprocalScalar(unsigned int total, const struct BlurDivisor* divisor, int i) {
+    (void)i;
+    return (unsigned int)(((uint64_t)total * divisor->multiplier) >> divisor->shift);
+}
+
+// defines name, moving the column sums one row down one sum at a time with AVERAGE, and nameFrom, which starts
+// at sum i and finishes the sums every vector version leaves over
+#define DEFINE_COLUMNS_SCALAR(name, AVERAGE) \
+static void name##From(int i, unsigned int* columns, const unsigned int* enter, const unsigned int* leave, \
+                       const struct BlurDivisor* divisor, unsigned char* out, int count) { \
+    for (; i < count; i++) { \
+        if (enter) columns[i] += enter[i]; \
+        if (out) out[i] = (unsigned char)AVERAGE(columns[i], divisor, i); \
+        if (leave) columns[i] -= leave[i]; \
+    } \
+} \
+\
+static void name(unsigned int* columns, const unsigned int* enter, const unsigned int* leave, \
+                 const struct BlurDivisor* divisor, unsigned char* out, int count) { \
+    name##From(0, columns, enter, leave, divisor, out, count); \
+}
+
+DEFINE_COLUMNS_SCALAR(borderScalar, divideScalar)
+DEFINE_COLUMNS_SCALAR(interiorScalar, reciprocalScalar)
+
+#ifdef BLUR_HAVE_X86
+/**
+ * Widen the 4 bytes of a BGRX pixel to 4 lanes of 32 bits.
+ */
+__attribute__((target("sse2")))
+static inline __m128i widenPixelSSE2(const unsigned char* pixel) {
+    int value;
+    memcpy(&value, pixel, sizeof(int));
+    __m128i bytes = _mm_unpacklo_epi8(_mm_cvtsi32_si128(value), _mm_setzero_si128());
+    return _mm_unpacklo_epi16(bytes, _mm_setzero_si128());
+}
+
+/**
+ * Sum a row of BGRX pixels with all 4 channels of a pixel in one register.
+ * Planes have a single channel and are summed by the scalar version.
+ */
+__attribute__((target("sse2")))
+static void sumsSSE2(const unsigned char* row, unsigned int* sums, int width, int channels, int radius) {
+    if (channels != 4) {
+        sumsScalar(row, sums, width, channels, radius);
+        return;
+    }
+
+    int left = radius < width ? radius : width;
+    int right = width - radius > left ? width - radius : left;
+    __m128i sum = _mm_setzero_si128();
+    int w = 0;
+
+    for (int x = 0; x < left; x++) {
+        sum = _mm_add_epi32(sum, widenPixelSSE2(row + x * 4));
+    }
+    for (; w < left; w++) {
+        if (w + radius < width) sum = _mm_add_epi32(sum, widenPixelSSE2(row + (w + radius) * 4));
+        _mm_storeu_si128((__m128i*)(sums + w * 4), sum);
+    }
+    for (; w < right; w++) {
+        sum = _mm_add_epi32(sum, widenPixelSSE2(row + (w + radius) * 4));
+        _mm_storeu_si128((__m128i*)(sums + w * 4), sum);
+        sum = _mm_sub_epi32(sum, widenPixelSSE2(row + (w - radius) * 4));
+    }
+    for (; w < width; w++) {
+        if (w + radius < width) sum = _mm_add_epi32(sum, widenPixelSSE2(row + (w + radius) * 4));
+        _mm_storeu_si128((__m128i*)(sums + w * 4), sum);
+        if (w - radius >= 0) sum = _mm_sub_epi32(sum, widenPixelSSE2(row + (w - radius) * 4));
+    }
+}
+
+/**
+ * Averages of 4 boxes near the edge. The sums stay far below 2^31, so they are
+ * converted to doubles as signed integers and divided there, which rounds down
+ * exactly like the integer division of the scalar version.
+ */
+__attribute__((target("sse2")))
+static inline __m128i divideSSE2(__m128i sum, const struct BlurDivisor* divisor, int i) {
+    const __m128d rows = _mm_set1_pd((double)divisor->rows);
+    __m128i pixels = _mm_loadu_si128((const __m128i*)(divisor->across + i));
+    __m128d low = _mm_div_pd(_mm_cvtepi32_pd(sum), _mm_mul_pd(_mm_cvtepi32_pd(pixels), rows));
+    __m128d high = _mm_div_pd(_mm_cvtepi32_pd(_mm_srli_si128(sum, 8)), _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(pixels, 8)), rows));
+    return _mm_unpacklo_epi64(_mm_cvttpd_epi32(low), _mm_cvttpd_epi32(high));
+}
+
+/**
+ * Averages of 4 boxes inside the row. pmuludq multiplies the even lanes to 64
+ * bits, the odd lanes are moved down for a second multiply, and the shifted
+ * products fit in the low half of their lane again.
+ */
+__attribute__((target("sse2")))
+static inline __m128i reciprocalSSE2(__m128i sum, const struct BlurDivisor* divisor, int i) {
+    const __m128i multiplier = _mm_set1_epi32((int)divisor->multiplier);
+    const __m128i shift = _mm_cvtsi32_si128(divisor->shift);
+    (void)i;
+    __m128i even = _mm_srl_epi64(_mm_mul_epu32(sum, multiplier), shift);
+    __m128i odd = _mm_srl_epi64(_mm_mul_epu32(_mm_srli_epi64(sum, 32), multiplier), shift);
+    return _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+}
+
+// defines name, moving the column sums one row down 16 sums at a time with AVERAGE and finishing with TAIL.
+// only updating the sums is left to TAIL as a whole, it happens for a few rows at the top of a region
+#define DEFINE_COLUMNS_SSE2(name, AVERAGE, TAIL) \
+__attribute__((target("sse2"))) \
+static void name(unsigned int* columns, const unsigned int* enter, const unsigned int* leave, \
+                 const struct BlurDivisor* divisor, unsigned char* out, int count) { \
+    int i = 0; \
+    for (; out && i + 16 <= count; i += 16) { \
+        __m128i averages[4]; \
+        for (int k = 0; k < 4; k++) { \
+            __m128i sum = _mm_loadu_si128((const __m128i*)(columns + i + 4 * k)); \
+            if (enter) sum = _mm_add_epi32(sum, _mm_loadu_si128((const __m128i*)(enter + i + 4 * k))); \
+            averages[k] = AVERAGE(sum, divisor, i + 4 * k); \
+            if (leave) sum = _mm_sub_epi32(sum, _mm_loadu_si128((const __m128i*)(leave + i + 4 * k))); \
+            _mm_storeu_si128((__m128i*)(columns + i + 4 * k), sum); \
+        } \
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(_mm_packs_epi32(averages[0], averages[1]), \
+                                                               _mm_packs_epi32(averages[2], averages[3]))); \
+    } \
+    TAIL(i, columns, enter, leave, divisor, out, count); \
+}
+
+DEFINE_COLUMNS_SSE2(borderSSE2, divideSSE2, borderScalarFrom)
+DEFINE_COLUMNS_SSE2(interiorSSE2, reciprocalSSE2, interiorScalarFrom)
+
+/**
+ * Averages of 8 boxes near the edge, 4 divisions per instruction.
+ */
+__attribute__((target("avx2")))
+static inline __m256i divideAVX2(__m256i sum, const struct BlurDivisor* divisor, int i) {
+    const __m256d rows = _mm256_set1_pd((double)divisor->rows);
+    __m256i pixels = _mm256_loadu_si256((const __m256i*)(divisor->across + i));
+    __m256d low = _mm256_div_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(sum)),
+                                _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(pixels)), rows));
+    __m256d high = _mm256_div_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(sum, 1)),
+                                 _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(pixels, 1)), rows));
+    return _mm256_set_m128i(_mm256_cvttpd_epi32(high), _mm256_cvttpd_epi32(low));
+}
+
+/**
+ * Averages of 8 boxes inside the row, multiplied like reciprocalSSE2.
+ */
+__attribute__((target("avx2")))
+static inline __m256i reciprocalAVX2(__m256i sum, const struct BlurDivisor* divisor, int i) {
+    const __m256i multiplier = _mm256_set1_epi32((int)divisor->multiplier);
+    const __m128i shift = _mm_cvtsi32_si128(divisor->shift);
+    (void)i;
+    __m256i even = _mm256_srl_epi64(_mm256_mul_epu32(sum, multiplier), shift);
+    __m256i odd = _mm256_srl_epi64(_mm256_mul_epu32(_mm256_srli_epi64(sum, 32), multiplier), shift);
+    return _mm256_or_si256(even, _mm256_slli_epi64(odd, 32));
+}
+
+// defines name, moving the column sums one row down 16 sums at a time, 8 sums per instruction
+#define DEFINE_COLUMNS_AVX2(name, AVERAGE, TAIL) \
+__attribute__((target("avx2"))) \
+static void name(unsigned int* columns, const unsigned int* enter, const unsigned int* leave, \
+                 const struct BlurDivisor* divisor, unsigned char* out, int count) { \
+    int i = 0; \
+    for (; out && i + 16 <= count; i += 16) { \
+        __m256i averages[2]; \
+        for (int k = 0; k < 2; k++) { \
+            __m256i sum = _mm256_loadu_si256((const __m256i*)(columns + i + 8 * k)); \
+            if (enter) sum = _mm256_add_epi32(sum, _mm256_loadu_si256((const __m256i*)(enter + i + 8 * k))); \
+            averages[k] = AVERAGE(sum, divisor, i + 8 * k); \
+            if (leave) sum = _mm256_sub_epi32(sum, _mm256_loadu_si256((const __m256i*)(leave + i + 8 * k))); \
+            _mm256_storeu_si256((__m256i*)(columns + i + 8 * k), sum); \
+        } \
+        __m128i low = _mm_packs_epi32(_mm256_castsi256_si128(averages[0]), _mm256_extracti128_si256(averages[0], 1)); \
+        __m128i high = _mm_packs_epi32(_mm256_castsi256_si128(averages[1]), _mm256_extracti128_si256(averages[1], 1)); \
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(low, high)); \
+    } \
+    TAIL(i, columns, enter, leave, divisor, out, count); \
+}
+
+DEFINE_COLUMNS_AVX2(borderAVX2, divideAVX2, borderScalarFrom)
+DEFINE_COLUMNS_AVX2(interiorAVX2, reciprocalAVX2, interiorScalarFrom)
+
+/**
+ * Averages of 16 boxes near the edge, 8 divisions per instruction.
+ */
+__attribute__((target("avx512f")))
+static inline __m512i divideAVX512(__m512i sum, const struct BlurDivisor* divisor, int i) {
+    const __m512d rows = _mm512_set1_pd((double)divisor->rows);
+    __m512i pixels = _mm512_loadu_si512((const void*)(divisor->across + i));
+    __m512d low = _mm512_div_pd(_mm512_cvtepi32_pd(_mm512_castsi512_si256(sum)),
+                                _mm512_mul_pd(_mm512_cvtepi32_pd(_mm512_castsi512_si256(pixels)), rows));
+    __m512d high = _mm512_div_pd(_mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(sum, 1)),
+                                 _mm512_mul_pd(_mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(pixels, 1)), rows));
+    return _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvttpd_epi32(low)), _mm512_cvttpd_epi32(high), 1);
+}
+
+/**
+ * Averages of 16 boxes inside the row, multiplied like reciprocalSSE2.
+ */
+__attribute__((target("avx512f")))
+static inline __m512i reciprocalAVX512(__m512i sum, const struct BlurDivisor* divisor, int i) {
+    const __m512i multiplier = _mm512_set1_epi32((int)divisor->multiplier);
+    const __m128i shift = _mm_cvtsi32_si128(divisor->shift);
+    (void)i;
+    __m512i even = _mm512_srl_epi64(_mm512_mul_epu32(sum, multiplier), shift);
+    __m512i odd = _mm512_srl_epi64(_mm512_mul_epu32(_mm512_srli_epi64(sum, 32), multiplier), shift);
+    return _mm512_or_si512(even, _mm512_slli_epi64(odd, 32));
+}
+
+// defines name, moving the column sums one row down 16 sums at a time in one register. the averages fit in a
+// byte, so they are narrowed with vpmovdb
+#define DEFINE_COLUMNS_AVX512(name, AVERAGE, TAIL) \
+__attribute__((target("avx512f"))) \
+static void name(unsigned int* columns, const unsigned int* enter, const unsigned int* leave, \
+                 const struct BlurDivisor* divisor, unsigned char* out, int count) { \
+    int i = 0; \
+    for (; out && i + 16 <= count; i += 16) { \
+        __m512i sum = _mm512_loadu_si512((const void*)(columns + i)); \
+        if (enter) sum = _mm512_add_epi32(sum, _mm512_loadu_si512((const void*)(enter + i))); \
+        _mm_storeu_si128((__m128i*)(out + i), _mm512_cvtepi32_epi8(AVERAGE(sum, divisor, i))); \
+        if (leave) sum = _mm512_sub_epi32(sum, _mm512_loadu_si512((const void*)(leave + i))); \
+        _mm512_storeu_si512((void*)(columns + i), sum); \
+    } \
+    TAIL(i, columns, enter, leave, divisor, out, count); \
+}
+
+DEFINE_COLUMNS_AVX512(borderAVX512, divideAVX512, borderScalarFrom)
+DEFINE_COLUMNS_AVX512(interiorAVX512, reciprocalAVX512, interiorScalarFrom)
+#endif
+
+// from narrowest to widest, the row sums are one pixel of 4 channels at a time at every width
+static const struct BlurKernels scalarKernels = {"scalar", sumsScalar, borderScalar, interiorScalar};
+#ifdef BLUR_HAVE_X86
+static const struct BlurKernels sse2Kernels = {"sse2", sumsSSE2, borderSSE2, interiorSSE2};
+static const struct BlurKernels avx2Kernels = {"avx2", sumsSSE2, borderAVX2, interiorAVX2};
+static const struct BlurKernels avx512Kernels = {"avx512", sumsSSE2, borderAVX512, interiorAVX512};
+#endif
+
+/**
+ * Pick the blur kernels to use.
+ *
+ * @param  name: scalar, sse2, avx2 or avx512, NULL for the widest supported
+ * @return the kernels, or NULL if the name is unknown or the CPU does not support them
+ */
+const struct BlurKernels* selectBlurKernels(const char* name) {
+#ifdef BLUR_HAVE_X86
+    const struct BlurKernels* kernels[] = {&scalarKernels, &sse2Kernels, &avx2Kernels, &avx512Kernels};
+    // __builtin_cpu_supports asks cpuid, and for the wide registers also checks that the OS saves them
+    __builtin_cpu_init();
+    bool supported[] = {true, __builtin_cpu_supports("sse2"), __builtin_cpu_supports("avx2"), __builtin_cpu_supports("avx512f")};
+#else
+    const struct BlurKernels* kernels[] = {&scalarKernels};
+    bool supported[] = {true};
+#endif
+    const struct BlurKernels* widest = NULL;
+
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (!supported[i]) continue;
+        if (name && strcmp(name, kernels[i]->name) == 0) return kernels[i];
+        widest = kernels[i];
+    }
+    return name ? NULL : widest;
+}
+
+/**
+ * Set the multiplier and shift of a divisor for boxes of the given number of pixels.
+ *
+ * @param  divisor: The divisor
+ * @param  pixels: Number of pixels of every box
+ */
+void setBlurDivisor(struct BlurDivisor* divisor, unsigned int pixels) {
+    // with multiplier = 2^shift / pixels rounded up, total * multiplier >> shift is off from total / pixels by
+    // less than total / 2^shift, so it rounds down to the same value for every total up to 255 * pixels once
+    // 2^shift reaches 255 * pixels^2. the product stays below 2^53
+    int shift = 0;
+    while (((uint64_t)1 << shift) < (uint64_t)255 * pixels * pixels) {
+        shift++;
+    }
+    divisor->multiplier = (unsigned int)((((uint64_t)1 << shift) + pixels - 1) / pixels);
+    divisor->shift = shift;
+}
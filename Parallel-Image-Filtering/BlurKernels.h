@@ -0,0 +1,127 @@
+/**
+* The inner loops of the box blur, in a plain C version that is the reference
+* and in SSE2, AVX2 and AVX-512 versions that work on many channels at once.
+* One set of kernels is picked when the program starts, from what the CPU
+* reports through cpuid, so the same binary runs at full width on every host.
+* Every loop comes as a branch-free interior kernel for the pixels whose box
+* lies inside the image, dividing by a constant through a reciprocal multiply,
+* and a border kernel for the few pixels near the edge of the image.
+*
+* @author Borys Banaszkiewicz
+* @version 1.0
+*/
+
+#ifndef BlurKernels_H
+#define BlurKernels_H 1
+
+struct BlurDivisor {
+	const unsigned int* across;	//pixels of every box inside the row, border kernels only
+	unsigned int rows;		//rows of every box inside the image, border kernels only
+	unsigned int multiplier;	//total * multiplier >> shift is the average of a box inside the row, interior kernels only
+	int shift;
+};
+
+struct BlurKernels {
+	const char* name;	//scalar, sse2, avx2 or avx512
+
+	/**
+	 * sum every channel of a row over the boxes of 2 * radius + 1 pixels
+	 * around each pixel, clipped to the row.
+	 *
+	 * @param  row: First byte of the row
+	 * @param  sums: Destination, one sum for every byte of the row
+	 * @param  width: Width of the row in pixels
+	 * @param  channels: Bytes of one pixel, 1 for a plane or 4 for BGRX pixels
+	 * @param  radius: Radius of the box
+	 */
+	void (*sums)(const unsigned char* row, unsigned int* sums, int width, int channels, int radius);
+
+	/**
+	 * move the column sums of a box one row down and store the averages of the
+	 * boxes between. The entering row is added first and the leaving row is
+	 * taken away after the averages are stored. border divides every box by
+	 * its own number of pixels, interior divides every box by the same number
+	 * through the multiplier of the divisor.
+	 *
+	 * @param  columns: Column sums, updated in place
+	 * @param  enter: Sums of the row entering the box, NULL when there is none
+	 * @param  leave: Sums of the row leaving the box, NULL when there is none
+	 * @param  divisor: Number of pixels of the boxes
+	 * @param  out: Destination of the averages, NULL to only update the sums
+	 * @param  count: Number of sums
+	 */
+	void (*border)(unsigned int* columns, const unsigned int* enter, const unsigned int* leave, const struct BlurDivisor* divisor,
+	               unsigned char* out, int count);
+	void (*interior)(unsigned int* columns, const unsigned int* enter, const unsigned int* leave, const struct BlurDivisor* divisor,
+	                 unsigned char* out, int count);
+};
+
+/**
+ * pick the blur kernels to use. Without a name the widest kernels the CPU
+ * supports are picked.
+ *
+ * @param  name: scalar, sse2, avx2 or avx512, NULL for the widest supported
+ * @return the kernels, or NULL if the name is unknown or the CPU does not support them
+ */
+const struct BlurKernels* selectBlurKernels(const char* name);
+
+
+/**
+ * set the multiplier and shift of a divisor so that interior kernels get the
+ * exact rounded down average of boxes of the given number of pixels, for every
+ * total up to 255 per pixel.
+ *
+ * @param  divisor: The divisor
+ * @param  pixels: Number of pixels of every box
+ */
+void setBlurDivisor(struct BlurDivisor* divisor, unsigned int pixels);
+
+
+/**
+ * define the static function name(above, row, below, step, width), a filter
+ * over the 3x3 neighbourhood of one channel of a row that writes the row in
+ * place from left to right. TAKE(value) is what every neighbour adds to the
+ * total and FINISH(total, count) turns the total of count neighbours into the
+ * new value. Pixels with all 9 neighbours go through a branch-free interior
+ * loop that passes the constant 9 as count, so FINISH can fold the division
+ * into a multiply. Only the first and last pixel and rows with a missing
+ * neighbour row take the border kernel name_border with its bounds tests.
+ */
+#define DEFINE_NEIGHBORHOOD_ROW(name, TAKE, FINISH) \
+static void name##_border(const unsigned char* above, unsigned char* row, const unsigned char* below, int step, int width, int w) { \
+	int first = w > 0 ? w - 1 : w; \
+	int last = w < width - 1 ? w + 1 : w; \
+	int total = 0, count = 0; \
+	for (int x = first; x <= last; x++) { \
+		if (above) { \
+			total += TAKE(above[x * step]); \
+			count++; \
+		} \
+		total += TAKE(row[x * step]); \
+		count++; \
+		if (below) { \
+			total += TAKE(below[x * step]); \
+			count++; \
+		} \
+	} \
+	row[w * step] = (unsigned char)(FINISH(total, count)); \
+} \
+\
+static void name(const unsigned char* above, unsigned char* row, const unsigned char* below, int step, int width) { \
+	if (!above || !below || width < 3) { \
+		for (int w = 0; w < width; w++) { \
+			name##_border(above, row, below, step, width, w); \
+		} \
+		return; \
+	} \
+	name##_border(above, row, below, step, width, 0); \
+	for (int w = 1; w < width - 1; w++) { \
+		int left = (w - 1) * step, right = (w + 1) * step, x = w * step; \
+		int total = TAKE(above[left]) + TAKE(above[x]) + TAKE(above[right]) \
+				  + TAKE(row[left]) + TAKE(row[x]) + TAKE(row[right]) \
+				  + TAKE(below[left]) + TAKE(below[x]) + TAKE(below[right]); \
+		row[x] = (unsigned char)(FINISH(total, 9)); \
+	} \
+	name##_border(above, row, below, step, width, width - 1); \
+}
+#endif
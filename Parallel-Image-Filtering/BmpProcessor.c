@@ -9,6 +9,12 @@
 
 #include "BmpProcessor.h"
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /**
  * Read BMP header of a BMP file.
@@ -58,6 +64,14 @@ void readDIBHeader(FILE* file, struct DIB_Header* header) {
     fread(&header->vertRes, sizeof(int), 1, file);
     fread(&header->colorNum, sizeof(int), 1, file);
     fread(&header->importantColorNum, sizeof(int), 1, file);
+
+    // everything below only exists in the larger headers, so start from zero for the fields that are missing
+    int* extra = &header->redMask;
+    int extra_count = (int)((sizeof(struct DIB_Header) - offsetof(struct DIB_Header, redMask)) / sizeof(int));
+    int extra_present = header->size > BMP_INFO_HEADER_SIZE ? (header->size - BMP_INFO_HEADER_SIZE) / (int)sizeof(int) : 0;
+
+    memset(extra, 0, sizeof(int) * extra_count);
+    fread(extra, sizeof(int), extra_present < extra_count ? extra_present : extra_count, file);
 }
 
 /**
@@ -78,6 +92,10 @@ void writeDIBHeader(FILE* file, struct DIB_Header* header) {
     fwrite(&header->vertRes, sizeof(int), 1, file);
     fwrite(&header->colorNum, sizeof(int), 1, file);
     fwrite(&header->importantColorNum, sizeof(int), 1, file);
+
+    int extra_count = (int)((sizeof(struct DIB_Header) - offsetof(struct DIB_Header, redMask)) / sizeof(int));
+    int extra_present = header->size > BMP_INFO_HEADER_SIZE ? (header->size - BMP_INFO_HEADER_SIZE) / (int)sizeof(int) : 0;
+    fwrite(&header->redMask, sizeof(int), extra_present < extra_count ? extra_present : extra_count, file);
 }
 
 /**
@@ -89,8 +107,8 @@ void writeDIBHeader(FILE* file, struct DIB_Header* header) {
  */
 void makeBMPHeader(struct BMP_Header* header, int width, int height) {
     strcpy(header->signature, "BM");
-    int row_size = (width * 3 + 3) & ~3;
-    header->size = 54 + row_size * height;
+    int row_size = rowSizeBMP(width, 24);
+    header->size = 54 + row_size * abs(height);
     header->reserved1 = 0;
     header->reserved2 = 0;
     header->offset_pixel_array = 54;
@@ -110,51 +128,544 @@ void makeDIBHeader(struct DIB_Header* header, int width, int height) {
     header->planes = 1;
     header->bitsPerPixel = 24;
     header->compression = 0;
-    int row_size = (width * 3 + 3) & ~3;
-    header->imageSize = row_size * height; // have to add padding
+    int row_size = rowSizeBMP(width, 24);
+    header->imageSize = row_size * abs(height); // have to add padding
     header->horizRes = 3780;
     header->vertRes = 3780;
     header->colorNum = 0;
     header->importantColorNum = 0;
+    memset(&header->redMask, 0, sizeof(struct DIB_Header) - offsetof(struct DIB_Header, redMask));
+}
+
+/**
+ * Make both headers of a 24 bit or 8 bit image.
+ *
+ * @param  bmpHeader: Pointer to the destination BMP header
+ * @param  dibHeader: Pointer to the destination DIB header
+ * @param  source: DIB header of the file the image came from, NULL for a new image
+ * @param  width: Width of the image that these headers are for
+ * @param  height: Height of the image that these headers are for
+ * @param  bitsPerPixel: Color depth of the image, 24 or 8
+ */
+void makeHeadersBMP(struct BMP_Header* bmpHeader, struct DIB_Header* dibHeader, const struct DIB_Header* source, int width, int height, int bitsPerPixel) {
+    makeBMPHeader(bmpHeader, width, height);
+    makeDIBHeader(dibHeader, width, height);
+
+    if (source) {
+        // V2 and V3 headers only add the channel masks, which uncompressed output files do not use
+        int size = source->size >= BMP_V5_HEADER_SIZE ? BMP_V5_HEADER_SIZE :
+                   source->size >= BMP_V4_HEADER_SIZE ? BMP_V4_HEADER_SIZE : BMP_INFO_HEADER_SIZE;
+        dibHeader->size = size;
+        dibHeader->horizRes = source->horizRes;
+        dibHeader->vertRes = source->vertRes;
+        if (size >= BMP_V4_HEADER_SIZE) {
+            memcpy(&dibHeader->redMask, &source->redMask, (size_t)(size - BMP_INFO_HEADER_SIZE));
+        }
+        // the profile lives after the pixel array of the input and is not copied
+        if (size >= BMP_V5_HEADER_SIZE &&
+            (dibHeader->colorSpaceType == BMP_PROFILE_LINKED || dibHeader->colorSpaceType == BMP_PROFILE_EMBEDDED)) {
+            dibHeader->colorSpaceType = BMP_COLOR_SPACE_SRGB;
+            dibHeader->profileData = 0;
+            dibHeader->profileSize = 0;
+        }
+    }
+
+    if (bitsPerPixel == 8) {
+        dibHeader->bitsPerPixel = 8;
+        dibHeader->colorNum = IMAGE_PALETTE_SIZE;
+        dibHeader->imageSize = rowSizeBMP(width, 8) * abs(height);
+    }
+    bmpHeader->offset_pixel_array = 14 + dibHeader->size + dibHeader->colorNum * (int)sizeof(struct Pixel32);
+    bmpHeader->size = bmpHeader->offset_pixel_array + dibHeader->imageSize;
+}
+
+/**
+ * Get the number of entries in the color table of a BMP file.
+ *
+ * @param  dibHeader: DIB header of the file
+ * @return number of colors, 0 for files without a color table
+ */
+static int paletteColorsBMP(const struct DIB_Header* dibHeader) {
+    if (dibHeader->bitsPerPixel != 8) return 0;
+    return dibHeader->colorNum > 0 ? dibHeader->colorNum : IMAGE_PALETTE_SIZE;
+}
+
+/**
+ * Copy the color table of a BMP file into a palette. Its entries already have
+ * the layout of struct Pixel32, entries missing from the table are black.
+ *
+ * @param  palette: Destination palette of IMAGE_PALETTE_SIZE colors
+ * @param  table: First entry of the color table
+ * @param  dibHeader: DIB header of the file
+ */
+static void copyColorTable(struct Pixel32* palette, const unsigned char* table, const struct DIB_Header* dibHeader) {
+    memset(palette, 0, sizeof(struct Pixel32) * IMAGE_PALETTE_SIZE);
+    memcpy(palette, table, sizeof(struct Pixel32) * paletteColorsBMP(dibHeader));
+}
+
+/**
+ * Check that a 32 bit BMP with BI_BITFIELDS compression stores its channels
+ * in the same order as struct Pixel32.
+ *
+ * @param  dibHeader: DIB header of the file
+ * @return true if the masks match
+ */
+static bool isBGRXMasks(const struct DIB_Header* dibHeader) {
+    return dibHeader->compression == 3 && dibHeader->size >= BMP_V2_HEADER_SIZE &&
+           dibHeader->redMask == 0xFF0000 && dibHeader->greenMask == 0xFF00 && dibHeader->blueMask == 0xFF;
+}
+
+/**
+ * Check that the pixels of a BMP file can be read by this library.
+ *
+ * @param  bmpHeader: BMP header of the file
+ * @param  dibHeader: DIB header of the file
+ * @return true if the file is supported
+ */
+bool isSupportedBMP(const struct BMP_Header* bmpHeader, const struct DIB_Header* dibHeader) {
+    return bmpHeader->signature[0] == 'B' && bmpHeader->signature[1] == 'M' &&
+           dibHeader->size >= BMP_INFO_HEADER_SIZE &&
+           bmpHeader->offset_pixel_array >= 14 + dibHeader->size &&
+           dibHeader->width > 0 && dibHeader->height != 0 && dibHeader->height != (int)0x80000000 &&
+           dibHeader->colorNum >= 0 && dibHeader->colorNum <= IMAGE_PALETTE_SIZE &&
+           bmpHeader->offset_pixel_array >= 14 + dibHeader->size + paletteColorsBMP(dibHeader) * (int)sizeof(struct Pixel32) &&
+           ((dibHeader->bitsPerPixel == 24 && dibHeader->compression == 0) ||
+            (dibHeader->bitsPerPixel == 8 && dibHeader->compression == 0) ||
+            (dibHeader->bitsPerPixel == 32 && (dibHeader->compression == 0 || isBGRXMasks(dibHeader))));
+}
+
+/**
+ * Get the number of bytes a row takes up in a BMP file, padding included.
+ *
+ * @param  width: Width of the image in pixels
+ * @param  bitsPerPixel: Color depth of the image
+ * @return size of a row in bytes
+ */
+int rowSizeBMP(int width, int bitsPerPixel) {
+    return (int)((((long long)width * bitsPerPixel + 31) / 32) * 4);
+}
+
+/**
+ * Get the image layout that matches the pixels of a BMP file.
+ *
+ * @param  bitsPerPixel: Color depth of the file
+ * @return layout of the pixels in the file
+ */
+static enum image_format fileFormat(int bitsPerPixel) {
+    return bitsPerPixel == 32 ? IMAGE_BGRX32 : bitsPerPixel == 8 ? IMAGE_INDEXED8 : IMAGE_BGR24;
 }
 
 /**
- * Read Pixels from BMP file based on width and height.
+ * Point the image of a mapping at its pixel array. Bottom-up files get a view
+ * that starts at the last row in the file and walks backwards, top-down files
+ * are viewed in file order. 32 bit files are viewed as they are, without
+ * any conversion, 8 bit files get the palette of the mapping.
+ *
+ * @param  mapping: The mapping, pixels and stride must be set
+ * @param  width: Width of the pixel array
+ * @param  height: Height of the pixel array, negative for a top-down file
+ * @param  bitsPerPixel: Color depth of the file
+ */
+static void viewPixelArray(struct BMP_Mapping* mapping, int width, int height, int bitsPerPixel) {
+    if (height < 0) {
+        viewImage(&mapping->image, mapping->pixels, width, -height, mapping->stride, fileFormat(bitsPerPixel));
+    }
+    else {
+        viewImage(&mapping->image, mapping->pixels + (size_t)mapping->stride * (height - 1), width, height, -mapping->stride, fileFormat(bitsPerPixel));
+    }
+    if (bitsPerPixel == 8) mapping->image.palette = mapping->palette;
+}
+
+/**
+ * Read Pixels from BMP file based on the width and height of the image. Rows
+ * are converted when the image has a different layout than the file.
  *
  * @param  file: A pointer to the file being read
- * @param  pArr: Pixel array to store the pixels being read
- * @param  width: Width of the pixel array of this image
- * @param  height: Height of the pixel array of this image
+ * @param  bmpHeader: BMP header of the file
+ * @param  dibHeader: DIB header of the file, a negative height means top-down rows
+ * @param  image: Image to store the pixels being read
+ * @return 0 on success, -1 if the row buffer could not be allocated
  */
-void readPixelsBMP(FILE* file, struct Pixel** pArr, int width, int height) {
-    fseek(file, 54, SEEK_SET);
+int readPixelsBMP(FILE* file, const struct BMP_Header* bmpHeader, const struct DIB_Header* dibHeader, struct Image* image) {
+    enum image_format format = fileFormat(dibHeader->bitsPerPixel);
+    int row_size = rowSizeBMP(image->width, dibHeader->bitsPerPixel);
+    bool top_down = dibHeader->height < 0;
+    unsigned char* buffer = format == image->format ? NULL : (unsigned char*)malloc(row_size);
+    struct Pixel32 palette[IMAGE_PALETTE_SIZE];
+    struct Image row;
 
-    int padding = (4 - (width * (int)sizeof(struct Pixel)) % 4) % 4;
+    // without the buffer the rows would be read straight into an image of another layout
+    if (format != image->format && !buffer) return -1;
 
-    for (int i = height - 1; i >= 0; i--) {
-        fread(pArr[i], sizeof(struct Pixel), width, file);
-        fseek(file, padding, SEEK_CUR);
+    memset(palette, 0, sizeof(palette));
+    if (format == IMAGE_INDEXED8) {
+        fseek(file, 14 + dibHeader->size, SEEK_SET);
+        fread(palette, sizeof(struct Pixel32), paletteColorsBMP(dibHeader), file);
+        if (image->format == IMAGE_INDEXED8) memcpy(image->palette, palette, sizeof(palette));
+    }
+    fseek(file, bmpHeader->offset_pixel_array, SEEK_SET);
+
+    viewImage(&row, buffer, image->width, 1, row_size, format);
+    row.palette = palette;
+
+    for (int r = 0; r < image->height; r++) {
+        int i = top_down ? r : image->height - 1 - r;
+        if (buffer) {
+            fread(buffer, 1, row_size, file);
+            copyImageRect(image, 0, i, &row, 0, 0, image->width, 1);
+        }
+        else {
+            fread(imageRow(image, i), pixelSize(format), image->width, file);
+            fseek(file, row_size - image->width * pixelSize(format), SEEK_CUR);
+        }
     }
+    free(buffer);
+    return 0;
 }
 
 /**
- * Write Pixels from BMP file based on width and height.
+ * Write Pixels from BMP file based on the width and height of the image. Rows
+ * are converted when the image has a different layout than the file.
  *
  * @param  file: A pointer to the file being read or written
- * @param  pArr: Pixel array of the image to write to the file
+ * @param  dibHeader: DIB header of the file, a negative height means top-down rows
+ * @param  image: Image to write to the file
+ * @return 0 on success, -1 if the row buffer could not be allocated
+ */
+int writePixelsBMP(FILE* file, const struct DIB_Header* dibHeader, const struct Image* image) {
+    enum image_format format = fileFormat(dibHeader->bitsPerPixel);
+    int row_size = rowSizeBMP(image->width, dibHeader->bitsPerPixel);
+    bool top_down = dibHeader->height < 0;
+    unsigned char* buffer = (unsigned char*)calloc(1, row_size);
+    struct Image row;
+
+    if (!buffer) return -1;
+    if (format == IMAGE_INDEXED8) {
+        fwrite(image->palette, sizeof(struct Pixel32), paletteColorsBMP(dibHeader), file);
+    }
+    viewImage(&row, buffer, image->width, 1, row_size, format);
+
+    for (int r = 0; r < image->height; r++) {
+        int i = top_down ? r : image->height - 1 - r;
+
+        // padding bytes at the end of the buffer stay zero
+        copyImageRect(&row, 0, 0, image, 0, i, image->width, 1);
+        fwrite(buffer, 1, row_size, file);
+    }
+    free(buffer);
+    return 0;
+}
+
+/**
+ * Map the pixel array of a BMP file into memory. The rows are exposed through
+ * mapping->image as a view in the order of the file, so it can be used
+ * wherever an image read by readPixelsBMP is expected.
+ *
+ * @param  file: A pointer to the file being mapped
+ * @param  bmpHeader: BMP header of the file
+ * @param  dibHeader: DIB header of the file, a negative height means top-down rows
+ * @param  mapping: Pointer to the destination mapping
+ * @return 0 on success, -1 if the file could not be mapped
+ */
+int mapPixelsBMP(FILE* file, const struct BMP_Header* bmpHeader, const struct DIB_Header* dibHeader, struct BMP_Mapping* mapping) {
+    struct stat st;
+    if (!isSupportedBMP(bmpHeader, dibHeader) || fstat(fileno(file), &st) != 0) return -1;
+
+    mapping->stride = rowSizeBMP(dibHeader->width, dibHeader->bitsPerPixel);
+    mapping->length = (size_t)st.st_size;
+    if (mapping->length < (size_t)bmpHeader->offset_pixel_array + (size_t)mapping->stride * abs(dibHeader->height)) return -1;
+
+    mapping->base = mmap(NULL, mapping->length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file), 0);
+    if (mapping->base == MAP_FAILED) return -1;
+    madvise(mapping->base, mapping->length, MADV_SEQUENTIAL);
+    madvise(mapping->base, mapping->length, MADV_WILLNEED);
+
+    mapping->pixels = (unsigned char*)mapping->base + bmpHeader->offset_pixel_array;
+    viewPixelArray(mapping, dibHeader->width, dibHeader->height, dibHeader->bitsPerPixel);
+    copyColorTable(mapping->palette, (unsigned char*)mapping->base + 14 + dibHeader->size, dibHeader);
+    return 0;
+}
+
+/**
+ * Release a mapping created by mapPixelsBMP or createMappedBMP.
+ *
+ * @param  mapping: The mapping to release
+ */
+void unmapPixelsBMP(struct BMP_Mapping* mapping) {
+    munmap(mapping->base, mapping->length);
+    mapping->base = NULL;
+}
+
+/**
+ * Create a BMP file of the given size and map it into memory so the pixels
+ * can be stored at their final offset.
+ *
+ * @param  path: Path of the file being created
+ * @param  mapping: Pointer to the destination mapping
+ * @param  source: DIB header of the file the image came from, NULL for a new image
  * @param  width: Width of the pixel array of this image
  * @param  height: Height of the pixel array of this image
+ * @param  bitsPerPixel: Color depth of the file, 24 or 8
+ * @return 0 on success, -1 if the file could not be created or mapped
+ */
+int createMappedBMP(const char* path, struct BMP_Mapping* mapping, const struct DIB_Header* source, int width, int height, int bitsPerPixel) {
+    struct BMP_Header BMP;
+    struct DIB_Header DIB;
+    makeHeadersBMP(&BMP, &DIB, source, width, height, bitsPerPixel);
+
+    FILE* file = fopen(path, "w+b");
+    if (!file) return -1;
+
+    writeBMPHeader(file, &BMP);
+    writeDIBHeader(file, &DIB);
+    fflush(file);
+
+    // growing the file with ftruncate leaves every byte after the headers zeroed, padding and color table included
+    mapping->stride = rowSizeBMP(width, bitsPerPixel);
+    mapping->length = (size_t)BMP.size;
+    if (width <= 0 || height == 0 || ftruncate(fileno(file), (off_t)mapping->length) != 0) {
+        fclose(file);
+        return -1;
+    }
+
+    mapping->base = mmap(NULL, mapping->length, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(file), 0);
+    fclose(file);
+    if (mapping->base == MAP_FAILED) return -1;
+
+    mapping->pixels = (unsigned char*)mapping->base + BMP.offset_pixel_array;
+    viewPixelArray(mapping, width, height, bitsPerPixel);
+    if (bitsPerPixel == 8) mapping->image.palette = (struct Pixel32*)((unsigned char*)mapping->base + 14 + DIB.size);
+    return 0;
+}
+
+#define BMP_IO_CHUNK (1 << 20)
+
+struct bmp_io_range {
+    int fd;
+    off_t offset;           //file offset of the pixel array
+    struct Image* image;
+    int row_size;           //bytes per row in the file, including padding
+    enum image_format format; //layout of the pixels in the file
+    struct Pixel32* palette; //color table of an 8 bit file
+    int first;              //first file row of this range
+    int last;               //one past the last file row of this range
+    bool top_down;          //file rows are stored top row first
+    bool write;
+    int status;
+};
+
+/**
+ * Read or write a block of a file with pread or pwrite until all of it is transferred.
+ *
+ * @param  fd: Descriptor of the file
+ * @param  buffer: Memory being read into or written from
+ * @param  length: Number of bytes to transfer
+ * @param  offset: File offset of the first byte
+ * @param  write: true to write the buffer, false to read it
+ * @return 0 on success, -1 if a transfer failed
+ */
+static int transferBlock(int fd, void* buffer, size_t length, off_t offset, bool write) {
+    for (size_t done = 0; done < length; ) {
+        ssize_t n = write ? pwrite(fd, (unsigned char*)buffer + done, length - done, offset + done)
+                          : pread(fd, (unsigned char*)buffer + done, length - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Read or write one range of file rows through a bounce buffer of about
+ * BMP_IO_CHUNK bytes. In bottom-up files, file row r is image row
+ * height - 1 - r, in top-down files it is image row r.
+ *
+ * @param  arg: The bmp_io_range to transfer
+ * @param  worker: Index of the pool worker running the transfer
  */
-void writePixelsBMP(FILE* file, struct Pixel** pArr, int width, int height) {
-    int padding = (4 - (width * (int)sizeof(struct Pixel)) % 4) % 4;
+static void transferRowRange(void* arg, int worker) {
+    struct bmp_io_range* range = (struct bmp_io_range*)arg;
+    int chunk_rows = BMP_IO_CHUNK / range->row_size > 0 ? BMP_IO_CHUNK / range->row_size : 1;
+    unsigned char* buffer = (unsigned char*)calloc((size_t)chunk_rows, range->row_size);
+    int last_row = range->image->height - 1;
+    (void)worker;
 
-    unsigned char pad[3] = {0,0,0};
+    range->status = buffer ? 0 : -1;
 
-    for (int i = height - 1; i >= 0; i--) {
-        fwrite(pArr[i], sizeof(struct Pixel), width, file);
+    for (int row = range->first; row < range->last && range->status == 0; row += chunk_rows) {
+        int rows = range->last - row < chunk_rows ? range->last - row : chunk_rows;
+        size_t length = (size_t)rows * range->row_size;
+        off_t offset = range->offset + (off_t)row * range->row_size;
 
-        if (padding > 0) {
-            fwrite(pad, 1, padding, file);
+        struct Image file_rows;
+        viewImage(&file_rows, buffer, range->image->width, rows, range->row_size, range->format);
+        file_rows.palette = range->palette;
+
+        if (range->write) {
+            // padding bytes stay zero from calloc since only the pixel bytes are ever copied in
+            for (int r = 0; r < rows; r++) {
+                copyImageRect(&file_rows, 0, r, range->image, 0, range->top_down ? row + r : last_row - (row + r), range->image->width, 1);
+            }
         }
+
+        range->status = transferBlock(range->fd, buffer, length, offset, range->write);
+
+        if (!range->write && range->status == 0) {
+            for (int r = 0; r < rows; r++) {
+                copyImageRect(range->image, 0, range->top_down ? row + r : last_row - (row + r), &file_rows, 0, r, range->image->width, 1);
+            }
+        }
+    }
+
+    free(buffer);
+}
+
+/**
+ * Split the rows of an image into one range per worker and transfer them in parallel.
+ *
+ * @param  fd: Descriptor of the file
+ * @param  bmpHeader: BMP header of the file, gives the offset of the pixel array
+ * @param  dibHeader: DIB header of the file, a negative height means top-down rows
+ * @param  image: Image being read or written
+ * @param  pool: Workers to transfer with
+ * @param  write: true to write the image, false to read it
+ * @return 0 on success, -1 if a transfer failed
+ */
+static int transferPixelsBMP(int fd, const struct BMP_Header* bmpHeader, const struct DIB_Header* dibHeader, struct Image* image, struct ThreadPool* pool, bool write) {
+    int threads = pool->count < image->height ? pool->count : image->height;
+    if (threads < 1) threads = 1;
+
+    struct bmp_io_range* ranges = (struct bmp_io_range*)malloc(sizeof(struct bmp_io_range) * threads);
+    if (!ranges) return -1;
+
+    int row_size = rowSizeBMP(image->width, dibHeader->bitsPerPixel);
+    int status = 0;
+    struct Pixel32 palette[IMAGE_PALETTE_SIZE];
+
+    // the color table sits between the headers and the pixel array and is small enough to move before the rows
+    memset(palette, 0, sizeof(palette));
+    if (dibHeader->bitsPerPixel == 8) {
+        size_t table_size = sizeof(struct Pixel32) * paletteColorsBMP(dibHeader);
+        status = transferBlock(fd, write ? (void*)image->palette : (void*)palette, table_size, 14 + dibHeader->size, write);
+        if (!write && image->format == IMAGE_INDEXED8) memcpy(image->palette, palette, sizeof(palette));
     }
-}
\ No newline at end of file
+
+    for (int i = 0; i < threads; i++) {
+        ranges[i].fd = fd;
+        ranges[i].offset = bmpHeader->offset_pixel_array;
+        ranges[i].image = image;
+        ranges[i].row_size = row_size;
+        ranges[i].format = fileFormat(dibHeader->bitsPerPixel);
+        ranges[i].palette = palette;
+        ranges[i].first = (int)((long long)image->height * i / threads);
+        ranges[i].last = (int)((long long)image->height * (i + 1) / threads);
+        ranges[i].top_down = dibHeader->height < 0;
+        ranges[i].write = write;
+        if (submitThreadPool(pool, transferRowRange, &ranges[i]) != 0) transferRowRange(&ranges[i], 0);
+    }
+    waitThreadPool(pool);
+
+    for (int i = 0; i < threads; i++) {
+        if (ranges[i].status != 0) status = -1;
+    }
+
+    free(ranges);
+    return status;
+}
+
+/**
+ * Read Pixels from BMP file with the workers of a pool using pread.
+ *
+ * @param  fd: Descriptor of the file being read
+ * @param  bmpHeader: BMP header of the file, gives the offset of the pixel array
+ * @param  dibHeader: DIB header of the file, a negative height means top-down rows
+ * @param  image: Image to store the pixels being read
+ * @param  pool: Workers to read with, one range of rows each
+ * @return 0 on success, -1 if a read failed
+ */
+int readPixelsBMPParallel(int fd, const struct BMP_Header* bmpHeader, const struct DIB_Header* dibHeader, struct Image* image, struct ThreadPool* pool) {
+    return transferPixelsBMP(fd, bmpHeader, dibHeader, image, pool, false);
+}
+
+/**
+ * Write Pixels to BMP file with the workers of a pool using pwrite.
+ *
+ * @param  fd: Descriptor of the file being written
+ * @param  bmpHeader: BMP header of the file, gives the offset of the pixel array
+ * @param  dibHeader: DIB header of the file, a negative height means top-down rows
+ * @param  image: Image to write to the file
+ * @param  pool: Workers to write with, one range of rows each
+ * @return 0 on success, -1 if a write failed
+ */
+int writePixelsBMPParallel(int fd, const struct BMP_Header* bmpHeader, const struct DIB_Header* dibHeader, const struct Image* image, struct ThreadPool* pool) {
+    return transferPixelsBMP(fd, bmpHeader, dibHeader, (struct Image*)image, pool, true);
+}
+
+/**
+ * Use a BMP file that was read into memory as a whole.
+ *
+ * @param  mapping: Pointer to the destination mapping
+ * @param  data: Contents of the file, must outlive the mapping
+ * @param  length: Length of the file in bytes
+ * @param  bmpHeader: Pointer to the destination BMP header
+ * @param  dibHeader: Pointer to the destination DIB header
+ * @return 0 on success, -1 if the buffer does not hold a complete image
+ */
+int openBufferBMP(struct BMP_Mapping* mapping, void* data, size_t length, struct BMP_Header* bmpHeader, struct DIB_Header* dibHeader) {
+    if (length < 54) return -1;
+
+    FILE* file = fmemopen(data, length, "rb");
+    if (!file) return -1;
+    readBMPHeader(file, bmpHeader);
+    readDIBHeader(file, dibHeader);
+    fclose(file);
+
+    if (!isSupportedBMP(bmpHeader, dibHeader)) return -1;
+
+    mapping->base = data;
+    mapping->length = length;
+    mapping->stride = rowSizeBMP(dibHeader->width, dibHeader->bitsPerPixel);
+    if (length < (size_t)bmpHeader->offset_pixel_array + (size_t)mapping->stride * abs(dibHeader->height)) return -1;
+
+    mapping->pixels = (unsigned char*)data + bmpHeader->offset_pixel_array;
+    viewPixelArray(mapping, dibHeader->width, dibHeader->height, dibHeader->bitsPerPixel);
+    copyColorTable(mapping->palette, (unsigned char*)data + 14 + dibHeader->size, dibHeader);
+    return 0;
+}
+
+/**
+ * Allocate a zeroed buffer laid out like a BMP file of the given size, headers included.
+ *
+ * @param  mapping: Pointer to the destination mapping
+ * @param  source: DIB header of the file the image came from, NULL for a new image
+ * @param  width: Width of the pixel array of this image
+ * @param  height: Height of the pixel array of this image
+ * @param  bitsPerPixel: Color depth of the file, 24 or 8
+ * @return 0 on success, -1 if the buffer could not be allocated
+ */
+int createBufferBMP(struct BMP_Mapping* mapping, const struct DIB_Header* source, int width, int height, int bitsPerPixel) {
+    struct BMP_Header BMP;
+    struct DIB_Header DIB;
+    makeHeadersBMP(&BMP, &DIB, source, width, height, bitsPerPixel);
+
+    if (width <= 0 || height == 0) return -1;
+
+    mapping->length = (size_t)BMP.size;
+    mapping->base = calloc(1, mapping->length);
+    if (!mapping->base) return -1;
+
+    FILE* file = fmemopen(mapping->base, mapping->length, "r+b");
+    if (!file) {
+        free(mapping->base);
+        return -1;
+    }
+    writeBMPHeader(file, &BMP);
+    writeDIBHeader(file, &DIB);
+    fclose(file);
+
+    mapping->stride = rowSizeBMP(width, bitsPerPixel);
+    mapping->pixels = (unsigned char*)mapping->base + BMP.offset_pixel_array;
+    viewPixelArray(mapping, width, height, bitsPerPixel);
+    if (bitsPerPixel == 8) mapping->image.palette = (struct Pixel32*)((unsigned char*)mapping->base + 14 + DIB.size);
+    return 0;
+}
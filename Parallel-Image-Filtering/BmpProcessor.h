@@ -8,7 +8,10 @@
 */
 
 #include <stdio.h>
-#include "PixelProcessor.h"
+#include <stddef.h>
+#include <stdbool.h>
+#include "Image.h"
+#include "ThreadPool.h"
 
 struct BMP_Header {
 	char signature[2];		//ID field
@@ -30,6 +33,37 @@ struct DIB_Header{
 	int vertRes; //	the vertical resolution of the image. (pixel per meter, signed integer)
 	int colorNum; // the number of colors in the color palette
 	int importantColorNum; // the number of important colors used
+	int redMask; // V2 and later: bit mask of the red channel
+	int greenMask; // V2 and later: bit mask of the green channel
+	int blueMask; // V2 and later: bit mask of the blue channel
+	int alphaMask; // V3 and later: bit mask of the alpha channel
+	int colorSpaceType; // V4 and later: the color space of the pixels
+	int endpoints[9]; // V4 and later: the CIE XYZ endpoints of the color space
+	int gammaRed; // V4 and later: tone response curve of the red channel
+	int gammaGreen; // V4 and later: tone response curve of the green channel
+	int gammaBlue; // V4 and later: tone response curve of the blue channel
+	int intent; // V5: rendering intent
+	int profileData; // V5: offset of the ICC profile from the start of this header
+	int profileSize; // V5: size of the ICC profile
+	int reserved; // V5: reserved, always 0
+};
+
+#define BMP_INFO_HEADER_SIZE 40
+#define BMP_V2_HEADER_SIZE 52	//BITMAPINFOHEADER followed by the red, green and blue masks
+#define BMP_V4_HEADER_SIZE 108
+#define BMP_V5_HEADER_SIZE 124
+
+#define BMP_COLOR_SPACE_SRGB 0x73524742		//'sRGB'
+#define BMP_PROFILE_LINKED 0x4C494E4B		//'LINK', the profile is a file named after the pixel array
+#define BMP_PROFILE_EMBEDDED 0x4D424544		//'MBED', the profile is stored after the pixel array
+
+struct BMP_Mapping {
+	void* base;		//start of the memory mapped or buffered file
+	size_t length;		//length of the mapping in bytes
+	unsigned char* pixels;	//first byte of the pixel array inside the mapping
+	int stride;		//bytes per row in the file, including padding
+	struct Image image;	//view of the mapped pixels, top row first
+	struct Pixel32 palette[IMAGE_PALETTE_SIZE]; //copy of the color table of an indexed input file
 };
 
 /**
@@ -52,6 +86,8 @@ void writeBMPHeader(FILE* file, struct BMP_Header* header);
 
 /**
  * read DIB header from a file. Useful for converting files from PPM to BMP.
+ * BITMAPINFOHEADER as well as the V4 and V5 headers are understood, fields
+ * that are not part of the header in the file are set to 0.
  *
  * @param  file: A pointer to the file being read
  * @param  header: Pointer to the destination DIB header
@@ -61,6 +97,7 @@ void readDIBHeader(FILE* file, struct DIB_Header* header);
 
 /**
  * write DIB header of a file. Useful for converting files from PPM to BMP.
+ * Only the fields covered by header->size are written.
  *
  * @param  file: A pointer to the file being written
  * @param  header: The header to write to the file
@@ -75,7 +112,7 @@ void writeDIBHeader(FILE* file, struct DIB_Header* header);
  *
  * @param  header: Pointer to the destination DIB header
  * @param  width: Width of the image that this header is for
- * @param  height: Height of the image that this header is for
+ * @param  height: Height of the image that this header is for, negative for a top-down image
  */
 void makeBMPHeader(struct BMP_Header* header, int width, int height);
 
@@ -86,28 +123,175 @@ void makeBMPHeader(struct BMP_Header* header, int width, int height);
  *
  * @param  header: Pointer to the destination DIB header
  * @param  width: Width of the image that this header is for
- * @param  height: Height of the image that this header is for
+ * @param  height: Height of the image that this header is for, negative for a top-down image
  */
 void makeDIBHeader(struct DIB_Header* header, int width, int height);
 
 
 /**
- * read Pixels from BMP file based on width and height.
+ * make both headers of a 24 bit or 8 bit image. 8 bit images get a full color
+ * table of IMAGE_PALETTE_SIZE entries between the headers and the pixel array.
+ * Headers made for a filtered copy of a file keep the resolution and the V4/V5
+ * color space of its DIB header, only the layout of the pixel array changes.
+ * An ICC profile is not carried over, so its color space becomes sRGB.
+ *
+ * @param  bmpHeader: Pointer to the destination BMP header
+ * @param  dibHeader: Pointer to the destination DIB header
+ * @param  source: DIB header of the file the image came from, NULL for a new image
+ * @param  width: Width of the image that these headers are for
+ * @param  height: Height of the image that these headers are for, negative for a top-down image
+ * @param  bitsPerPixel: Color depth of the image, 24 or 8
+ */
+void makeHeadersBMP(struct BMP_Header* bmpHeader, struct DIB_Header* dibHeader, const struct DIB_Header* source, int width, int height, int bitsPerPixel);
+
+
+/**
+ * check that the pixels of a BMP file can be read by this library: an
+ * uncompressed 8, 24 or 32 bit image (32 bit may also use BI_BITFIELDS with
+ * BGRX masks) with a BITMAPINFOHEADER or a V4/V5 header.
+ *
+ * @param  bmpHeader: BMP header of the file
+ * @param  dibHeader: DIB header of the file
+ * @return true if the file is supported
+ */
+bool isSupportedBMP(const struct BMP_Header* bmpHeader, const struct DIB_Header* dibHeader);
+
+
+/**
+ * get the number of bytes a row takes up in a BMP file, padding included.
+ *
+ * @param  width: Width of the image in pixels
+ * @param  bitsPerPixel: Color depth of the image
+ * @return size of a row in bytes
+ */
+int rowSizeBMP(int width, int bitsPerPixel);
+
+
+/**
+ * read Pixels from BMP file based on the width and height of the image. The
+ * pixel array is read from offset_pixel_array and rows are read in the order
+ * the file stores them, so top-down files need no reordering. Pixels are
+ * converted to the layout of the image if it differs from the file. The color
+ * table of 8 bit files is read into the palette of indexed images, any other
+ * image gets the colors the indexes refer to.
  *
  * @param  file: A pointer to the file being read
- * @param  pArr: Pixel array to store the pixels being read
- * @param  width: Width of the pixel array of this image
- * @param  height: Height of the pixel array of this image
+ * @param  bmpHeader: BMP header of the file
+ * @param  dibHeader: DIB header of the file, a negative height means top-down rows
+ * @param  image: Image to store the pixels being read
+ * @return 0 on success, -1 if the row buffer could not be allocated
  */
-void readPixelsBMP(FILE* file, struct Pixel** pArr, int width, int height);
+int readPixelsBMP(FILE* file, const struct BMP_Header* bmpHeader, const struct DIB_Header* dibHeader, struct Image* image);
 
 
 /**
- * write Pixels from BMP file based on width and height.
+ * write Pixels from BMP file based on the width and height of the image.
+ * Pixels are converted to the color depth given by the DIB header. 8 bit
+ * files can only be written from indexed images, their palette is written
+ * first as the color table, so the file must be positioned right after the headers.
  *
  * @param  file: A pointer to the file being read or written
- * @param  pArr: Pixel array of the image to write to the file
+ * @param  dibHeader: DIB header of the file, a negative height means top-down rows
+ * @param  image: Image to write to the file
+ * @return 0 on success, -1 if the row buffer could not be allocated
+ */
+int writePixelsBMP(FILE* file, const struct DIB_Header* dibHeader, const struct Image* image);
+
+
+/**
+ * map the pixel array of a BMP file into memory instead of reading it. The
+ * mapping is private, so pages are only copied by the kernel once a filter
+ * writes to them and the file itself is never modified.
+ *
+ * @param  file: A pointer to the file being mapped
+ * @param  bmpHeader: BMP header of the file
+ * @param  dibHeader: DIB header of the file, a negative height means top-down rows
+ * @param  mapping: Pointer to the destination mapping
+ * @return 0 on success, -1 if the file could not be mapped
+ */
+int mapPixelsBMP(FILE* file, const struct BMP_Header* bmpHeader, const struct DIB_Header* dibHeader, struct BMP_Mapping* mapping);
+
+
+/**
+ * release a mapping created by mapPixelsBMP or createMappedBMP.
+ *
+ * @param  mapping: The mapping to release
+ */
+void unmapPixelsBMP(struct BMP_Mapping* mapping);
+
+
+/**
+ * create a BMP file of the given size and map it into memory so the pixels
+ * can be stored at their final offset. The headers are made by makeHeadersBMP
+ * and the padding at the end of every row is zeroed. The palette of an 8 bit
+ * file is the color table inside the mapping.
+ *
+ * @param  path: Path of the file being created
+ * @param  mapping: Pointer to the destination mapping
+ * @param  source: DIB header of the file the image came from, NULL for a new image
+ * @param  width: Width of the pixel array of this image
+ * @param  height: Height of the pixel array of this image, negative for a top-down file
+ * @param  bitsPerPixel: Color depth of the file, 24 or 8
+ * @return 0 on success, -1 if the file could not be created or mapped
+ */
+int createMappedBMP(const char* path, struct BMP_Mapping* mapping, const struct DIB_Header* source, int width, int height, int bitsPerPixel);
+
+
+/**
+ * read Pixels from BMP file with the workers of a pool. The rows are split into
+ * ranges and every worker reads its own range with pread, so the file
+ * position is never shared. The color table is handled like readPixelsBMP does.
+ *
+ * @param  fd: Descriptor of the file being read
+ * @param  bmpHeader: BMP header of the file, gives the offset of the pixel array
+ * @param  dibHeader: DIB header of the file, a negative height means top-down rows
+ * @param  image: Image to store the pixels being read
+ * @param  pool: Workers to read with, one range of rows each
+ * @return 0 on success, -1 if a read failed
+ */
+int readPixelsBMPParallel(int fd, const struct BMP_Header* bmpHeader, const struct DIB_Header* dibHeader, struct Image* image, struct ThreadPool* pool);
+
+
+/**
+ * write Pixels to BMP file with the workers of a pool. The rows are split into
+ * ranges and every worker writes its own range, padding included, with pwrite.
+ * The palette of an indexed image is written as the color table of an 8 bit file.
+ *
+ * @param  fd: Descriptor of the file being written
+ * @param  bmpHeader: BMP header of the file, gives the offset of the pixel array
+ * @param  dibHeader: DIB header of the file, a negative height means top-down rows
+ * @param  image: Image to write to the file
+ * @param  pool: Workers to write with, one range of rows each
+ * @return 0 on success, -1 if a write failed
+ */
+int writePixelsBMPParallel(int fd, const struct BMP_Header* bmpHeader, const struct DIB_Header* dibHeader, const struct Image* image, struct ThreadPool* pool);
+
+
+/**
+ * use a BMP file that was read into memory as a whole. The headers are parsed
+ * from the buffer and mapping->image views the pixels inside it.
+ *
+ * @param  mapping: Pointer to the destination mapping
+ * @param  data: Contents of the file, must outlive the mapping
+ * @param  length: Length of the file in bytes
+ * @param  bmpHeader: Pointer to the destination BMP header
+ * @param  dibHeader: Pointer to the destination DIB header
+ * @return 0 on success, -1 if the buffer does not hold a complete image
+ */
+int openBufferBMP(struct BMP_Mapping* mapping, void* data, size_t length, struct BMP_Header* bmpHeader, struct DIB_Header* dibHeader);
+
+
+/**
+ * allocate a zeroed buffer laid out like a BMP file of the given size, headers
+ * included, so the pixels can be stored at their final offset and the buffer
+ * written out with a single write. The buffer is released with free(mapping->base).
+ * The palette of an 8 bit file is the color table inside the buffer.
+ *
+ * @param  mapping: Pointer to the destination mapping
+ * @param  source: DIB header of the file the image came from, NULL for a new image
  * @param  width: Width of the pixel array of this image
- * @param  height: Height of the pixel array of this image
+ * @param  height: Height of the pixel array of this image, negative for a top-down file
+ * @param  bitsPerPixel: Color depth of the file, 24 or 8
+ * @return 0 on success, -1 if the buffer could not be allocated
  */
-void writePixelsBMP(FILE* file, struct Pixel** pArr, int width, int height);
\ No newline at end of file
+int createBufferBMP(struct BMP_Mapping* mapping, const struct DIB_Header* source, int width, int height, int bitsPerPixel);
@@ -0,0 +1,492 @@
+/**
+* Implementation of the contiguous image type and its pixel conversions.
+*
+* @author Borys Banaszkiewicz
+* @version 1.0
+*/
+
+#include "Image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IMAGE_HAVE_SSSE3 1
+#endif
+
+/**
+ * Map a block backed by huge pages, from hugetlbfs if possible or else as
+ * ordinary memory aligned to IMAGE_HUGE_PAGE_SIZE and marked for transparent
+ * huge pages. The kernel only uses transparent huge pages for whole aligned
+ * 2 MB ranges, so the mapping is made larger and the unaligned ends are cut off.
+ *
+ * @param  size: Bytes needed
+ * @param  block_size: Pointer to the destination length of the mapping
+ * @param  pages: Pointer to the destination kind of pages
+ * @return the block, or NULL if nothing could be mapped
+ */
+static void* mapHugePages(size_t size, size_t* block_size, enum image_pages* pages) {
+    size_t length = (size + IMAGE_HUGE_PAGE_SIZE - 1) & ~(size_t)(IMAGE_HUGE_PAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+    void* block = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (block != MAP_FAILED) {
+        *block_size = length;
+        *pages = IMAGE_PAGES_HUGETLB;
+        return block;
+    }
+#endif
+
+    unsigned char* mapping = (unsigned char*)mmap(NULL, length + IMAGE_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) return NULL;
+
+    unsigned char* aligned = (unsigned char*)(((uintptr_t)mapping + IMAGE_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(IMAGE_HUGE_PAGE_SIZE - 1));
+    if (aligned > mapping) {
+        munmap(mapping, (size_t)(aligned - mapping));
+    }
+    munmap(aligned + length, (size_t)(mapping + IMAGE_HUGE_PAGE_SIZE - aligned));
+
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, length, MADV_HUGEPAGE);
+#endif
+    *block_size = length;
+    *pages = IMAGE_PAGES_TRANSPARENT;
+    return aligned;
+}
+
+/**
+ * Allocate an image as a single aligned block.
+ *
+ * @param  image: Pointer to the destination image
+ * @param  width: Width of the image in pixels
+ * @param  height: Height of the image in pixels
+ * @param  format: Layout of the pixels
+ * @return 0 on success, -1 if the allocation failed
+ */
+int allocImage(struct Image* image, int width, int height, enum image_format format) {
+    size_t size = imageBlockSize(width, height, format);
+    size_t block_size = 0;
+    enum image_pages pages = IMAGE_PAGES_SMALL;
+    void* block = NULL;
+
+    if (size >= IMAGE_HUGE_THRESHOLD) {
+        block = mapHugePages(size, &block_size, &pages);
+    }
+    if (!block && posix_memalign(&block, IMAGE_ALIGNMENT, size) != 0) return -1;
+
+    layoutImage(image, block, width, height, format);
+    image->block = block;
+    image->block_size = block_size;
+    image->pages = pages;
+    return 0;
+}
+
+/**
+ * Get the size of the block allocImage would allocate for an image.
+ *
+ * @param  width: Width of the image in pixels
+ * @param  height: Height of the image in pixels
+ * @param  format: Layout of the pixels
+ * @return size of the block in bytes
+ */
+size_t imageBlockSize(int width, int height, enum image_format format) {
+    ptrdiff_t stride = ((ptrdiff_t)width * pixelSize(format) + IMAGE_ALIGNMENT - 1) & ~(ptrdiff_t)(IMAGE_ALIGNMENT - 1);
+    // the palette is a multiple of IMAGE_ALIGNMENT so the rows after it stay aligned
+    size_t palette_size = format == IMAGE_INDEXED8 ? IMAGE_PALETTE_SIZE * sizeof(struct Pixel32) : 0;
+    return palette_size + (size_t)stride * (height > 0 ? height : 1) * (format == IMAGE_PLANAR ? 3 : 1);
+}
+
+/**
+ * Lay an image out in a block owned by someone else.
+ *
+ * @param  image: Pointer to the destination image
+ * @param  block: Block of at least imageBlockSize bytes, aligned to IMAGE_ALIGNMENT
+ * @param  width: Width of the image in pixels
+ * @param  height: Height of the image in pixels
+ * @param  format: Layout of the pixels
+ */
+void layoutImage(struct Image* image, void* block, int width, int height, enum image_format format) {
+    ptrdiff_t stride = ((ptrdiff_t)width * pixelSize(format) + IMAGE_ALIGNMENT - 1) & ~(ptrdiff_t)(IMAGE_ALIGNMENT - 1);
+    size_t palette_size = format == IMAGE_INDEXED8 ? IMAGE_PALETTE_SIZE * sizeof(struct Pixel32) : 0;
+
+    viewImage(image, (unsigned char*)block + palette_size, width, height, stride, format);
+    image->plane_stride = format == IMAGE_PLANAR ? stride * (height > 0 ? height : 1) : 0;
+    if (palette_size > 0) {
+        image->palette = (struct Pixel32*)block;
+        memset(image->palette, 0, palette_size);
+    }
+}
+
+/**
+ * Make an image that refers to pixels owned by someone else.
+ *
+ * @param  image: Pointer to the destination image
+ * @param  data: First byte of the top row
+ * @param  width: Width of the image in pixels
+ * @param  height: Height of the image in pixels
+ * @param  stride: Bytes from one row to the next, negative for bottom-up rows
+ * @param  format: Layout of the pixels
+ */
+void viewImage(struct Image* image, unsigned char* data, int width, int height, ptrdiff_t stride, enum image_format format) {
+    image->data = data;
+    image->width = width;
+    image->height = height;
+    image->stride = stride;
+    image->format = format;
+    image->plane_stride = 0;
+    image->palette = NULL;
+    image->block = NULL;
+    image->block_size = 0;
+    image->pages = IMAGE_PAGES_SMALL;
+}
+
+/**
+ * Release the pixels of an image allocated by allocImage.
+ *
+ * @param  image: The image to release
+ */
+void freeImage(struct Image* image) {
+    if (image->block_size > 0) {
+        munmap(image->block, image->block_size);
+    }
+    else {
+        free(image->block);
+    }
+    image->block = NULL;
+    image->block_size = 0;
+    image->data = NULL;
+    image->palette = NULL;
+}
+
+/**
+ * Count how many bytes of an image are backed by huge pages right now.
+ *
+ * @param  image: The image
+ * @return bytes of the block in huge pages, 0 for views and small images
+ */
+size_t hugePagesImage(const struct Image* image) {
+    if (image->pages == IMAGE_PAGES_HUGETLB) return image->block_size;
+    if (image->pages != IMAGE_PAGES_TRANSPARENT) return 0;
+
+    FILE* smaps = fopen("/proc/self/smaps", "r");
+    if (!smaps) return 0;
+
+    // every mapping starts with a "start-end perms ..." line followed by "Name: value kB" lines. the block
+    // may have been split into several mappings, so every one inside it is counted
+    uintptr_t first = (uintptr_t)image->block;
+    uintptr_t last = first + image->block_size;
+    bool inside = false;
+    size_t huge = 0;
+    char line[256];
+
+    while (fgets(line, sizeof(line), smaps)) {
+        unsigned long start, end, kb;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            inside = start >= first && end <= last;
+        }
+        else if (inside && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+            huge += (size_t)kb * 1024;
+        }
+    }
+
+    fclose(smaps);
+    return huge;
+}
+
+#ifdef IMAGE_HAVE_SSSE3
+/**
+ * Widen 16 pixels at a time from 3 to 4 bytes. Three loads of 16 bytes hold
+ * 16 pixels, palignr lines every group of 4 pixels up at the start of a
+ * register and one shuffle spreads them out, zeroing the fourth byte.
+ *
+ * @return number of pixels converted, the caller does the rest
+ */
+__attribute__((target("ssse3")))
+static int expandPixelsSSSE3(struct Pixel32* dst, const struct Pixel* src, int count) {
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const unsigned char* in = (const unsigned char*)src;
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(in + i * 3));
+        __m128i b = _mm_loadu_si128((const __m128i*)(in + i * 3 + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(in + i * 3 + 32));
+
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(a, spread));
+        _mm_storeu_si128((__m128i*)(dst + i + 4), _mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), spread));
+        _mm_storeu_si128((__m128i*)(dst + i + 8), _mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), spread));
+        _mm_storeu_si128((__m128i*)(dst + i + 12), _mm_shuffle_epi8(_mm_srli_si128(c, 4), spread));
+    }
+    return i;
+}
+
+/**
+ * Narrow 16 pixels at a time from 4 to 3 bytes, the reverse of expandPixelsSSSE3.
+ *
+ * @return number of pixels converted, the caller does the rest
+ */
+__attribute__((target("ssse3")))
+static int packPixelsSSSE3(struct Pixel* dst, const struct Pixel32* src, int count) {
+    const __m128i gather = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    unsigned char* out = (unsigned char*)dst;
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m128i p0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i)), gather);
+        __m128i p1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i + 4)), gather);
+        __m128i p2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i + 8)), gather);
+        __m128i p3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i + 12)), gather);
+
+        _mm_storeu_si128((__m128i*)(out + i * 3), _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+        _mm_storeu_si128((__m128i*)(out + i * 3 + 16), _mm_or_si128(_mm_srli_si128(p1, 4), _mm_slli_si128(p2, 8)));
+        _mm_storeu_si128((__m128i*)(out + i * 3 + 32), _mm_or_si128(_mm_srli_si128(p2, 8), _mm_slli_si128(p3, 4)));
+    }
+    return i;
+}
+
+/**
+ * Split 16 BGRX pixels at a time into three planes. One shuffle groups the
+ * four blue, green, red and unused bytes of 4 pixels into 32 bit lanes, then
+ * a 4x4 transpose of those lanes gathers 16 bytes of each channel.
+ *
+ * @return number of pixels converted, the caller does the rest
+ */
+__attribute__((target("ssse3")))
+static int splitPixelsSSSE3(unsigned char* blue, unsigned char* green, unsigned char* red, const struct Pixel32* src, int count) {
+    const __m128i group = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m128i p0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i)), group);
+        __m128i p1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i + 4)), group);
+        __m128i p2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i + 8)), group);
+        __m128i p3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i + 12)), group);
+        __m128i bg01 = _mm_unpacklo_epi32(p0, p1);
+        __m128i bg23 = _mm_unpacklo_epi32(p2, p3);
+        __m128i rx01 = _mm_unpackhi_epi32(p0, p1);
+        __m128i rx23 = _mm_unpackhi_epi32(p2, p3);
+
+        _mm_storeu_si128((__m128i*)(blue + i), _mm_unpacklo_epi64(bg01, bg23));
+        _mm_storeu_si128((__m128i*)(green + i), _mm_unpackhi_epi64(bg01, bg23));
+        _mm_storeu_si128((__m128i*)(red + i), _mm_unpacklo_epi64(rx01, rx23));
+    }
+    return i;
+}
+
+/**
+ * Interleave 16 pixels at a time from three planes into BGRX, the reverse of splitPixelsSSSE3.
+ *
+ * @return number of pixels converted, the caller does the rest
+ */
+__attribute__((target("ssse3")))
+static int mergePixelsSSSE3(struct Pixel32* dst, const unsigned char* blue, const unsigned char* green, const unsigned char* red, int count) {
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i*)(blue + i));
+        __m128i g = _mm_loadu_si128((const __m128i*)(green + i));
+        __m128i r = _mm_loadu_si128((const __m128i*)(red + i));
+        __m128i bg_lo = _mm_unpacklo_epi8(b, g);
+        __m128i bg_hi = _mm_unpackhi_epi8(b, g);
+        __m128i rx_lo = _mm_unpacklo_epi8(r, zero);
+        __m128i rx_hi = _mm_unpackhi_epi8(r, zero);
+
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi16(bg_lo, rx_lo));
+        _mm_storeu_si128((__m128i*)(dst + i + 4), _mm_unpackhi_epi16(bg_lo, rx_lo));
+        _mm_storeu_si128((__m128i*)(dst + i + 8), _mm_unpacklo_epi16(bg_hi, rx_hi));
+        _mm_storeu_si128((__m128i*)(dst + i + 12), _mm_unpackhi_epi16(bg_hi, rx_hi));
+    }
+    return i;
+}
+#endif
+
+/**
+ * Split a run of BGRX pixels into three planes.
+ *
+ * @param  blue: First destination byte in the blue plane
+ * @param  green: First destination byte in the green plane
+ * @param  red: First destination byte in the red plane
+ * @param  src: First source pixel
+ * @param  count: Number of pixels to split
+ */
+static void splitPixels(unsigned char* blue, unsigned char* green, unsigned char* red, const struct Pixel32* src, int count) {
+    int i = 0;
+#ifdef IMAGE_HAVE_SSSE3
+    if (__builtin_cpu_supports("ssse3")) i = splitPixelsSSSE3(blue, green, red, src, count);
+#endif
+    for (; i < count; i++) {
+        blue[i] = src[i].blue;
+        green[i] = src[i].green;
+        red[i] = src[i].red;
+    }
+}
+
+/**
+ * Interleave a run of pixels from three planes into BGRX.
+ *
+ * @param  dst: First destination pixel
+ * @param  blue: First source byte in the blue plane
+ * @param  green: First source byte in the green plane
+ * @param  red: First source byte in the red plane
+ * @param  count: Number of pixels to merge
+ */
+static void mergePixels(struct Pixel32* dst, const unsigned char* blue, const unsigned char* green, const unsigned char* red, int count) {
+    int i = 0;
+#ifdef IMAGE_HAVE_SSSE3
+    if (__builtin_cpu_supports("ssse3")) i = mergePixelsSSSE3(dst, blue, green, red, count);
+#endif
+    for (; i < count; i++) {
+        dst[i].blue = blue[i];
+        dst[i].green = green[i];
+        dst[i].red = red[i];
+        dst[i].unused = 0;
+    }
+}
+
+/**
+ * Look a run of indexes up in a palette.
+ *
+ * @param  dst: First destination pixel
+ * @param  src: First index
+ * @param  palette: The IMAGE_PALETTE_SIZE colors the indexes refer to
+ * @param  count: Number of pixels to look up
+ */
+static void lookupPixels(struct Pixel32* dst, const unsigned char* src, const struct Pixel32* palette, int count) {
+    for (int i = 0; i < count; i++) {
+        dst[i] = palette[src[i]];
+        dst[i].unused = 0;
+    }
+}
+
+/**
+ * Convert a run of pixels from one layout to another.
+ *
+ * @param  dst: First destination pixel
+ * @param  dst_format: Layout of the destination pixels
+ * @param  src: First source pixel
+ * @param  src_format: Layout of the source pixels
+ * @param  count: Number of pixels to convert
+ */
+void convertPixels(void* dst, enum image_format dst_format, const void* src, enum image_format src_format, int count) {
+    if (dst_format == src_format) {
+        memmove(dst, src, (size_t)count * pixelSize(src_format));
+        return;
+    }
+
+    int i = 0;
+
+    if (dst_format == IMAGE_BGRX32) {
+        struct Pixel32* out = (struct Pixel32*)dst;
+        const struct Pixel* in = (const struct Pixel*)src;
+#ifdef IMAGE_HAVE_SSSE3
+        if (__builtin_cpu_supports("ssse3")) i = expandPixelsSSSE3(out, in, count);
+#endif
+        for (; i < count; i++) {
+            out[i].blue = in[i].blue;
+            out[i].green = in[i].green;
+            out[i].red = in[i].red;
+            out[i].unused = 0;
+        }
+    }
+    else {
+        struct Pixel* out = (struct Pixel*)dst;
+        const struct Pixel32* in = (const struct Pixel32*)src;
+#ifdef IMAGE_HAVE_SSSE3
+        if (__builtin_cpu_supports("ssse3")) i = packPixelsSSSE3(out, in, count);
+#endif
+        for (; i < count; i++) {
+            out[i].blue = in[i].blue;
+            out[i].green = in[i].green;
+            out[i].red = in[i].red;
+        }
+    }
+}
+
+/**
+ * Copy a rectangle of pixels between two images, converting the layout on the way.
+ *
+ * @param  dst: Destination image
+ * @param  dst_x: Left column of the rectangle in the destination
+ * @param  dst_y: Top row of the rectangle in the destination
+ * @param  src: Source image
+ * @param  src_x: Left column of the rectangle in the source
+ * @param  src_y: Top row of the rectangle in the source
+ * @param  width: Width of the rectangle in pixels
+ * @param  height: Height of the rectangle in pixels
+ */
+void copyImageRect(struct Image* dst, int dst_x, int dst_y, const struct Image* src, int src_x, int src_y, int width, int height) {
+    // 24 bit pixels go through a small BGRX buffer on their way to or from the planes
+    struct Pixel32 chunk[256];
+
+    for (int h = 0; h < height; h++) {
+        if (src->format == IMAGE_INDEXED8 && dst->format != IMAGE_INDEXED8) {
+            const unsigned char* in = (const unsigned char*)imagePixel(src, src_x, src_y + h);
+
+            for (int w = 0; w < width; w += 256) {
+                int count = width - w < 256 ? width - w : 256;
+
+                if (dst->format == IMAGE_BGRX32) {
+                    lookupPixels((struct Pixel32*)imagePixel(dst, dst_x + w, dst_y + h), in + w, src->palette, count);
+                    continue;
+                }
+                lookupPixels(chunk, in + w, src->palette, count);
+                if (dst->format == IMAGE_PLANAR) {
+                    splitPixels(imagePlaneRow(dst, PLANE_BLUE, dst_y + h) + dst_x + w, imagePlaneRow(dst, PLANE_GREEN, dst_y + h) + dst_x + w,
+                                imagePlaneRow(dst, PLANE_RED, dst_y + h) + dst_x + w, chunk, count);
+                }
+                else {
+                    convertPixels(imagePixel(dst, dst_x + w, dst_y + h), dst->format, chunk, IMAGE_BGRX32, count);
+                }
+            }
+        }
+        else if (dst->format != IMAGE_PLANAR && src->format != IMAGE_PLANAR) {
+            convertPixels(imagePixel(dst, dst_x, dst_y + h), dst->format, imagePixel(src, src_x, src_y + h), src->format, width);
+        }
+        else if (dst->format == IMAGE_PLANAR && src->format == IMAGE_PLANAR) {
+            for (int p = 0; p < 3; p++) {
+                memmove(imagePlaneRow(dst, p, dst_y + h) + dst_x, imagePlaneRow(src, p, src_y + h) + src_x, (size_t)width);
+            }
+        }
+        else if (dst->format == IMAGE_PLANAR) {
+            unsigned char* blue = imagePlaneRow(dst, PLANE_BLUE, dst_y + h) + dst_x;
+            unsigned char* green = imagePlaneRow(dst, PLANE_GREEN, dst_y + h) + dst_x;
+            unsigned char* red = imagePlaneRow(dst, PLANE_RED, dst_y + h) + dst_x;
+            const unsigned char* in = (const unsigned char*)imagePixel(src, src_x, src_y + h);
+
+            for (int w = 0; w < width; w += 256) {
+                int count = width - w < 256 ? width - w : 256;
+                const struct Pixel32* pixels = (const struct Pixel32*)(in + (ptrdiff_t)w * pixelSize(src->format));
+
+                if (src->format != IMAGE_BGRX32) {
+                    convertPixels(chunk, IMAGE_BGRX32, pixels, src->format, count);
+                    pixels = chunk;
+                }
+                splitPixels(blue + w, green + w, red + w, pixels, count);
+            }
+        }
+        else {
+            const unsigned char* blue = imagePlaneRow(src, PLANE_BLUE, src_y + h) + src_x;
+            const unsigned char* green = imagePlaneRow(src, PLANE_GREEN, src_y + h) + src_x;
+            const unsigned char* red = imagePlaneRow(src, PLANE_RED, src_y + h) + src_x;
+            unsigned char* out = (unsigned char*)imagePixel(dst, dst_x, dst_y + h);
+
+            for (int w = 0; w < width; w += 256) {
+                int count = width - w < 256 ? width - w : 256;
+                unsigned char* pixels = out + (ptrdiff_t)w * pixelSize(dst->format);
+
+                if (dst->format == IMAGE_BGRX32) {
+                    mergePixels((struct Pixel32*)pixels, blue + w, green + w, red + w, count);
+                }
+                else {
+                    mergePixels(chunk, blue + w, green + w, red + w, count);
+                    convertPixels(pixels, dst->format, chunk, IMAGE_BGRX32, count);
+                }
+            }
+        }
+    }
+}
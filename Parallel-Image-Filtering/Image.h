@@ -0,0 +1,230 @@
+/**
+* An image type that keeps every row of a picture in one contiguous block.
+*
+* @author Borys Banaszkiewicz
+* @version 1.0
+*/
+
+#ifndef Image_H
+#define Image_H 1
+
+#include <stddef.h>
+#include "PixelProcessor.h"
+
+#define IMAGE_ALIGNMENT 64
+#define IMAGE_PALETTE_SIZE 256
+#define IMAGE_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define IMAGE_HUGE_THRESHOLD (4 * 1024 * 1024)	//images at least this large ask for huge pages
+
+enum image_format {
+	IMAGE_BGR24,	//struct Pixel, the layout of 24 bit BMP files
+	IMAGE_BGRX32,	//struct Pixel32, the layout filters work on and of 32 bit BMP files
+	IMAGE_PLANAR,	//one plane of bytes per channel, blue then green then red
+	IMAGE_INDEXED8	//one byte per pixel indexing the palette, the layout of 8 bit BMP files
+};
+
+enum image_pages {
+	IMAGE_PAGES_SMALL,		//ordinary pages from posix_memalign
+	IMAGE_PAGES_TRANSPARENT,	//mapped with MADV_HUGEPAGE, the kernel may or may not back it with huge pages
+	IMAGE_PAGES_HUGETLB		//mapped with MAP_HUGETLB, always backed by huge pages
+};
+
+#define PLANE_BLUE 0
+#define PLANE_GREEN 1
+#define PLANE_RED 2
+
+struct Image {
+	unsigned char* data;	//first byte of the top row
+	int width;		//width of the image in pixels
+	int height;		//height of the image in pixels
+	ptrdiff_t stride;	//bytes from one row to the next, negative for bottom-up views
+	enum image_format format; //layout of the pixels
+	ptrdiff_t plane_stride;	//bytes from one channel plane to the next, planar images only
+	struct Pixel32* palette; //IMAGE_PALETTE_SIZE colors, indexed images only
+	void* block;		//allocation owned by the image, NULL for views
+	size_t block_size;	//length of the block when it was mapped, 0 when it came from posix_memalign
+	enum image_pages pages;	//kind of pages the block asked for
+};
+
+/**
+ * allocate an image as a single aligned block. Each row starts on an
+ * IMAGE_ALIGNMENT boundary. Planar images keep their three planes one after
+ * the other in the same block, indexed images keep their zeroed palette in front
+ * of the rows. Blocks of at least IMAGE_HUGE_THRESHOLD bytes are mapped with
+ * 2 MB pages from hugetlbfs when some are reserved, or else aligned to 2 MB
+ * and marked with MADV_HUGEPAGE for transparent huge pages.
+ *
+ * @param  image: Pointer to the destination image
+ * @param  width: Width of the image in pixels
+ * @param  height: Height of the image in pixels
+ * @param  format: Layout of the pixels
+ * @return 0 on success, -1 if the allocation failed
+ */
+int allocImage(struct Image* image, int width, int height, enum image_format format);
+
+
+/**
+ * get the size of the block allocImage would allocate for an image.
+ *
+ * @param  width: Width of the image in pixels
+ * @param  height: Height of the image in pixels
+ * @param  format: Layout of the pixels
+ * @return size of the block in bytes
+ */
+size_t imageBlockSize(int width, int height, enum image_format format);
+
+
+/**
+ * lay an image out in a block owned by someone else, e.g. an arena, the same
+ * way allocImage lays it out in its own block. freeImage leaves the block alone.
+ *
+ * @param  image: Pointer to the destination image
+ * @param  block: Block of at least imageBlockSize bytes, aligned to IMAGE_ALIGNMENT
+ * @param  width: Width of the image in pixels
+ * @param  height: Height of the image in pixels
+ * @param  format: Layout of the pixels
+ */
+void layoutImage(struct Image* image, void* block, int width, int height, enum image_format format);
+
+
+/**
+ * make an image that refers to pixels owned by someone else, e.g. a mapped file.
+ * Indexed views get their palette assigned by the caller.
+ *
+ * @param  image: Pointer to the destination image
+ * @param  data: First byte of the top row
+ * @param  width: Width of the image in pixels
+ * @param  height: Height of the image in pixels
+ * @param  stride: Bytes from one row to the next, negative for bottom-up rows
+ * @param  format: Layout of the pixels
+ */
+void viewImage(struct Image* image, unsigned char* data, int width, int height, ptrdiff_t stride, enum image_format format);
+
+
+/**
+ * release the pixels of an image allocated by allocImage. Views are left untouched.
+ *
+ * @param  image: The image to release
+ */
+void freeImage(struct Image* image);
+
+
+/**
+ * count how many bytes of an image are backed by huge pages right now.
+ * Transparent huge pages are looked up in /proc/self/smaps, so the result
+ * only means something once the image has been written.
+ *
+ * @param  image: The image
+ * @return bytes of the block in huge pages, 0 for views and small images
+ */
+size_t hugePagesImage(const struct Image* image);
+
+
+/**
+ * convert a run of interleaved pixels from one layout to another. 24 bit pixels are
+ * widened to 32 bit and narrowed back with SSSE3 shuffles when the CPU has
+ * them, pixels that already have the right layout are only copied.
+ *
+ * @param  dst: First destination pixel
+ * @param  dst_format: Layout of the destination pixels, IMAGE_BGR24 or IMAGE_BGRX32
+ * @param  src: First source pixel
+ * @param  src_format: Layout of the source pixels, IMAGE_BGR24 or IMAGE_BGRX32
+ * @param  count: Number of pixels to convert
+ */
+void convertPixels(void* dst, enum image_format dst_format, const void* src, enum image_format src_format, int count);
+
+
+/**
+ * copy a rectangle of pixels between two images, converting the layout on the way.
+ * Moving between interleaved and planar images transposes 16 pixels at a time
+ * with SSSE3 when the CPU has it. Indexed pixels are looked up in the palette of
+ * the source, they can only be copied into another indexed image as they are.
+ *
+ * @param  dst: Destination image
+ * @param  dst_x: Left column of the rectangle in the destination
+ * @param  dst_y: Top row of the rectangle in the destination
+ * @param  src: Source image
+ * @param  src_x: Left column of the rectangle in the source
+ * @param  src_y: Top row of the rectangle in the source
+ * @param  width: Width of the rectangle in pixels
+ * @param  height: Height of the rectangle in pixels
+ */
+void copyImageRect(struct Image* dst, int dst_x, int dst_y, const struct Image* src, int src_x, int src_y, int width, int height);
+
+
+/**
+ * get the size of one pixel in bytes.
+ *
+ * @param  format: Layout of the pixels
+ * @return size of a pixel in bytes
+ */
+static inline int pixelSize(enum image_format format) {
+	return format == IMAGE_BGRX32 ? (int)sizeof(struct Pixel32) : format == IMAGE_BGR24 ? (int)sizeof(struct Pixel) : 1;
+}
+
+
+/**
+ * get a row of an image.
+ *
+ * @param  image: The image
+ * @param  row: Index of the row, 0 being the top row
+ * @return pointer to the first pixel of the row, a struct Pixel or struct Pixel32 depending on the format,
+ *         the first byte of the row in the blue plane for planar images or the first index for indexed images
+ */
+static inline void* imageRow(const struct Image* image, int row) {
+	return image->data + image->stride * row;
+}
+
+
+/**
+ * get a pixel of an image.
+ *
+ * @param  image: The image
+ * @param  x: Column of the pixel
+ * @param  y: Row of the pixel, 0 being the top row
+ * @return pointer to the pixel
+ */
+static inline void* imagePixel(const struct Image* image, int x, int y) {
+	return image->data + image->stride * y + (ptrdiff_t)x * pixelSize(image->format);
+}
+
+
+/**
+ * get a row of one channel plane of a planar image.
+ *
+ * @param  image: The planar image
+ * @param  plane: PLANE_BLUE, PLANE_GREEN or PLANE_RED
+ * @param  row: Index of the row, 0 being the top row
+ * @return pointer to the first byte of the row
+ */
+static inline unsigned char* imagePlaneRow(const struct Image* image, int plane, int row) {
+	return image->data + image->plane_stride * plane + image->stride * row;
+}
+
+
+/**
+ * get one channel of a pixel, in any layout but indexed. Channels of
+ * interleaved pixels follow each other in the same order as the planes.
+ *
+ * @param  image: The image
+ * @param  channel: PLANE_BLUE, PLANE_GREEN or PLANE_RED
+ * @param  x: Column of the pixel
+ * @param  y: Row of the pixel, 0 being the top row
+ * @return pointer to the channel, the same channel of the next pixel is channelStep bytes further
+ */
+static inline unsigned char* imageChannel(const struct Image* image, int channel, int x, int y) {
+	if (image->format == IMAGE_PLANAR) return imagePlaneRow(image, channel, y) + x;
+	return (unsigned char*)imagePixel(image, x, y) + channel;
+}
+
+
+/**
+ * get the distance between one channel of a pixel and the same channel of the next pixel.
+ *
+ * @param  format: Layout of the pixels
+ * @return distance in bytes
+ */
+static inline int channelStep(enum image_format format) {
+	return format == IMAGE_PLANAR ? 1 : pixelSize(format);
+}
+#endif
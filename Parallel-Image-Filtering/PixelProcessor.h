@@ -16,6 +16,14 @@ struct Pixel{
 	unsigned char red;
 };
 
+//4 byte pixel used while filtering so every pixel sits on its own aligned 32 bit lane
+struct Pixel32{
+	unsigned char blue;
+	unsigned char green;
+	unsigned char red;
+	unsigned char unused;
+};
+
 //NOT NEEDED FOR THREADING HW.
 void colorShiftPixels(struct Pixel** pArr, int width, int height, int rShift, int gShift, int bShift);
 #endif
\ No newline at end of file
@@ -0,0 +1,452 @@
+/**
+* Implementation of the QOI reader and the multithreaded QOI writer.
+*
+* @author Borys Banaszkiewicz
+* @version 1.0
+*/
+
+#include "QoiProcessor.h"
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK 0xc0
+#define QOI_INDEX_SIZE 64
+#define QOI_MAX_RUN 62
+#define QOI_PIXELS_MAX 400000000u
+
+struct qoi_color {
+    unsigned char red;
+    unsigned char green;
+    unsigned char blue;
+    unsigned char alpha;
+};
+
+struct qoi_band {
+    const struct Image* image;
+    int first;              //first row of this band
+    int last;               //one past the last row of this band
+    unsigned char* data;    //encoded chunks of this band
+    size_t length;          //number of bytes in data
+    int status;
+};
+
+/**
+ * Get the slot of a color in the index of previously seen colors.
+ *
+ * @param  color: The color
+ * @return index position of the color
+ */
+static int hashColor(struct qoi_color color) {
+    return (color.red * 3 + color.green * 5 + color.blue * 7 + color.alpha * 11) % QOI_INDEX_SIZE;
+}
+
+/**
+ * Check whether two colors are the same.
+ *
+ * @return true if all four channels match
+ */
+static bool sameColor(struct qoi_color a, struct qoi_color b) {
+    return a.red == b.red && a.green == b.green && a.blue == b.blue && a.alpha == b.alpha;
+}
+
+/**
+ * Read a big endian 32 bit value.
+ *
+ * @param  bytes: First byte of the value
+ * @return the value
+ */
+static unsigned int readBigEndian(const unsigned char* bytes) {
+    return (unsigned int)bytes[0] << 24 | (unsigned int)bytes[1] << 16 | (unsigned int)bytes[2] << 8 | bytes[3];
+}
+
+/**
+ * Write a big endian 32 bit value.
+ *
+ * @param  bytes: First destination byte
+ * @param  value: The value
+ */
+static void writeBigEndian(unsigned char* bytes, unsigned int value) {
+    bytes[0] = (unsigned char)(value >> 24);
+    bytes[1] = (unsigned char)(value >> 16);
+    bytes[2] = (unsigned char)(value >> 8);
+    bytes[3] = (unsigned char)value;
+}
+
+/**
+ * Make QOI header based on width and height.
+ *
+ * @param  header: Pointer to the destination QOI header
+ * @param  width: Width of the image that this header is for
+ * @param  height: Height of the image that this header is for
+ */
+void makeQOIHeader(struct QOI_Header* header, int width, int height) {
+    memcpy(header->magic, "qoif", 4);
+    header->width = (unsigned int)width;
+    header->height = (unsigned int)height;
+    header->channels = 3;
+    header->colorspace = 0;
+}
+
+/**
+ * Check that a QOI header describes an image this library can decode.
+ *
+ * @param  header: QOI header of the file
+ * @return true if the file is supported
+ */
+bool isSupportedQOI(const struct QOI_Header* header) {
+    return memcmp(header->magic, "qoif", 4) == 0 &&
+           header->width > 0 && header->height > 0 && header->width <= 0x7fffffffu && header->height <= 0x7fffffffu &&
+           header->height < QOI_PIXELS_MAX / header->width &&
+           (header->channels == 3 || header->channels == 4) && header->colorspace <= 1;
+}
+
+/**
+ * Check whether a block of memory starts with the QOI magic.
+ *
+ * @param  data: Contents of the file
+ * @param  length: Length of the file in bytes
+ * @return true if the data looks like a QOI file
+ */
+bool isQOIData(const void* data, size_t length) {
+    return length >= 4 && memcmp(data, "qoif", 4) == 0;
+}
+
+/**
+ * Check whether a file starts with the QOI magic.
+ *
+ * @param  file: A pointer to the file being checked
+ * @return true if the file looks like a QOI file
+ */
+bool isQOIFile(FILE* file) {
+    char magic[4];
+    size_t length;
+
+    fseek(file, 0, SEEK_SET);
+    length = fread(magic, 1, sizeof(magic), file);
+    fseek(file, 0, SEEK_SET);
+    return isQOIData(magic, length);
+}
+
+/**
+ * Check whether a path names a QOI file.
+ *
+ * @param  path: Path of the file
+ * @return true if the path ends in ".qoi"
+ */
+bool isQOIPath(const char* path) {
+    size_t length = strlen(path);
+    return length >= 4 && strcmp(path + length - 4, ".qoi") == 0;
+}
+
+/**
+ * Decode a QOI file that was read into memory as a whole.
+ *
+ * @param  data: Contents of the file
+ * @param  length: Length of the file in bytes
+ * @param  header: Pointer to the destination QOI header
+ * @param  image: Pointer to the destination image, freed with freeImage
+ * @return 0 on success, -1 if the data is not a complete supported image
+ */
+int decodeQOI(const void* data, size_t length, struct QOI_Header* header, struct Image* image) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    if (length < QOI_HEADER_SIZE + QOI_END_MARKER_SIZE) return -1;
+
+    memcpy(header->magic, bytes, 4);
+    header->width = readBigEndian(bytes + 4);
+    header->height = readBigEndian(bytes + 8);
+    header->channels = bytes[12];
+    header->colorspace = bytes[13];
+    if (!isSupportedQOI(header) || allocImage(image, (int)header->width, (int)header->height, IMAGE_BGRX32) != 0) return -1;
+
+    struct qoi_color index[QOI_INDEX_SIZE];
+    struct qoi_color color = {0, 0, 0, 255};
+    size_t p = QOI_HEADER_SIZE;
+    size_t end = length - QOI_END_MARKER_SIZE;
+    int run = 0;
+
+    memset(index, 0, sizeof(index));
+
+    for (int h = 0; h < image->height; h++) {
+        struct Pixel32* row = imageRow(image, h);
+
+        for (int w = 0; w < image->width; w++) {
+            if (run > 0) {
+                run--;
+            }
+            else {
+                if (p >= end) {
+                    freeImage(image);
+                    return -1;
+                }
+                int op = bytes[p++];
+
+                // every op but the one byte ones carries its operands right after it
+                if (op == QOI_OP_RGB || op == QOI_OP_RGBA || (op & QOI_MASK) == QOI_OP_LUMA) {
+                    size_t operands = op == QOI_OP_RGB ? 3 : op == QOI_OP_RGBA ? 4 : 1;
+                    if (end - p < operands) {
+                        freeImage(image);
+                        return -1;
+                    }
+                }
+
+                if (op == QOI_OP_RGB) {
+                    color.red = bytes[p];
+                    color.green = bytes[p + 1];
+                    color.blue = bytes[p + 2];
+                    p += 3;
+                }
+                else if (op == QOI_OP_RGBA) {
+                    color.red = bytes[p];
+                    color.green = bytes[p + 1];
+                    color.blue = bytes[p + 2];
+                    color.alpha = bytes[p + 3];
+                    p += 4;
+                }
+                else if ((op & QOI_MASK) == QOI_OP_INDEX) {
+                    color = index[op];
+                }
+                else if ((op & QOI_MASK) == QOI_OP_DIFF) {
+                    color.red += ((op >> 4) & 0x03) - 2;
+                    color.green += ((op >> 2) & 0x03) - 2;
+                    color.blue += (op & 0x03) - 2;
+                }
+                else if ((op & QOI_MASK) == QOI_OP_LUMA) {
+                    int green_diff = (op & 0x3f) - 32;
+                    int second = bytes[p++];
+                    color.red += green_diff - 8 + ((second >> 4) & 0x0f);
+                    color.green += green_diff;
+                    color.blue += green_diff - 8 + (second & 0x0f);
+                }
+                else {
+                    run = op & 0x3f;
+                }
+                index[hashColor(color)] = color;
+            }
+
+            row[w].blue = color.blue;
+            row[w].green = color.green;
+            row[w].red = color.red;
+            row[w].unused = 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Encode one band of rows. The band starts with a QOI_OP_RGB so it does not
+ * depend on the last color of the band before it, and only uses index entries
+ * that were filled by its own pixels, since the decoder fills the same entries
+ * with the same colors while it decodes the band.
+ *
+ * @param  arg: The qoi_band to encode
+ * @param  worker: Index of the pool worker running the encoder
+ */
+static void encodeBand(void* arg, int worker) {
+    struct qoi_band* band = (struct qoi_band*)arg;
+    const struct Image* image = band->image;
+    struct qoi_color index[QOI_INDEX_SIZE];
+    bool valid[QOI_INDEX_SIZE];
+    struct qoi_color previous = {0, 0, 0, 255};
+    bool started = false;
+    int run = 0;
+    struct Image converted;
+    unsigned char* out;
+    (void)worker;
+
+    band->length = 0;
+    band->data = (unsigned char*)malloc((size_t)(band->last - band->first) * image->width * 4 + 1);
+    band->status = band->data ? 0 : -1;
+    if (band->status != 0) return;
+
+    // rows in any other layout are turned into BGRX one at a time
+    if (image->format != IMAGE_BGRX32 && allocImage(&converted, image->width, 1, IMAGE_BGRX32) != 0) {
+        band->status = -1;
+        return;
+    }
+
+    memset(valid, 0, sizeof(valid));
+    out = band->data;
+
+    for (int h = band->first; h < band->last; h++) {
+        const struct Pixel32* row;
+
+        if (image->format == IMAGE_BGRX32) {
+            row = imageRow(image, h);
+        }
+        else {
+            copyImageRect(&converted, 0, 0, image, 0, h, image->width, 1);
+            row = imageRow(&converted, 0);
+        }
+
+        for (int w = 0; w < image->width; w++) {
+            struct qoi_color color = {row[w].red, row[w].green, row[w].blue, 255};
+
+            if (started && sameColor(color, previous)) {
+                if (++run == QOI_MAX_RUN) {
+                    *out++ = (unsigned char)(QOI_OP_RUN | (run - 1));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                *out++ = (unsigned char)(QOI_OP_RUN | (run - 1));
+                run = 0;
+            }
+
+            int slot = hashColor(color);
+            if (valid[slot] && sameColor(index[slot], color)) {
+                *out++ = (unsigned char)(QOI_OP_INDEX | slot);
+            }
+            else {
+                signed char red_diff = (signed char)(color.red - previous.red);
+                signed char green_diff = (signed char)(color.green - previous.green);
+                signed char blue_diff = (signed char)(color.blue - previous.blue);
+                signed char red_green = (signed char)(red_diff - green_diff);
+                signed char blue_green = (signed char)(blue_diff - green_diff);
+
+                index[slot] = color;
+                valid[slot] = true;
+
+                if (started && red_diff >= -2 && red_diff <= 1 && green_diff >= -2 && green_diff <= 1 && blue_diff >= -2 && blue_diff <= 1) {
+                    *out++ = (unsigned char)(QOI_OP_DIFF | (red_diff + 2) << 4 | (green_diff + 2) << 2 | (blue_diff + 2));
+                }
+                else if (started && green_diff >= -32 && green_diff <= 31 && red_green >= -8 && red_green <= 7 && blue_green >= -8 && blue_green <= 7) {
+                    *out++ = (unsigned char)(QOI_OP_LUMA | (green_diff + 32));
+                    *out++ = (unsigned char)((red_green + 8) << 4 | (blue_green + 8));
+                }
+                else {
+                    *out++ = QOI_OP_RGB;
+                    *out++ = color.red;
+                    *out++ = color.green;
+                    *out++ = color.blue;
+                }
+            }
+            previous = color;
+            started = true;
+        }
+    }
+
+    // a run never carries over into the next band
+    if (run > 0) {
+        *out++ = (unsigned char)(QOI_OP_RUN | (run - 1));
+    }
+
+    band->length = (size_t)(out - band->data);
+    if (image->format != IMAGE_BGRX32) freeImage(&converted);
+}
+
+/**
+ * Encode an image as a QOI file in memory.
+ *
+ * @param  image: Image to encode, in any layout
+ * @param  pool: Workers to encode with, one band each
+ * @param  data: Pointer to the destination buffer, released with free
+ * @param  length: Pointer to the length of the encoded file in bytes
+ * @return 0 on success, -1 if the buffers could not be allocated
+ */
+int encodeQOI(const struct Image* image, struct ThreadPool* pool, void** data, size_t* length) {
+    int threads = pool->count < image->height ? pool->count : image->height;
+    if (threads < 1) threads = 1;
+
+    struct qoi_band* bands = (struct qoi_band*)calloc(threads, sizeof(struct qoi_band));
+    if (!bands) return -1;
+
+    int status = 0;
+    size_t total = QOI_HEADER_SIZE + QOI_END_MARKER_SIZE;
+
+    for (int i = 0; i < threads; i++) {
+        bands[i].image = image;
+        bands[i].first = (int)((long long)image->height * i / threads);
+        bands[i].last = (int)((long long)image->height * (i + 1) / threads);
+        if (submitThreadPool(pool, encodeBand, &bands[i]) != 0) encodeBand(&bands[i], 0);
+    }
+    waitThreadPool(pool);
+
+    for (int i = 0; i < threads; i++) {
+        if (bands[i].status != 0) status = -1;
+        total += bands[i].length;
+    }
+
+    unsigned char* out = status == 0 ? (unsigned char*)malloc(total) : NULL;
+    if (out) {
+        struct QOI_Header header;
+        unsigned char* p = out;
+
+        makeQOIHeader(&header, image->width, image->height);
+        memcpy(p, header.magic, 4);
+        writeBigEndian(p + 4, header.width);
+        writeBigEndian(p + 8, header.height);
+        p[12] = header.channels;
+        p[13] = header.colorspace;
+        p += QOI_HEADER_SIZE;
+
+        for (int i = 0; i < threads; i++) {
+            memcpy(p, bands[i].data, bands[i].length);
+            p += bands[i].length;
+        }
+
+        // the stream ends with seven zero bytes and a one
+        memset(p, 0, QOI_END_MARKER_SIZE - 1);
+        p[QOI_END_MARKER_SIZE - 1] = 1;
+
+        *data = out;
+        *length = total;
+    }
+    else {
+        status = -1;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        free(bands[i].data);
+    }
+    free(bands);
+    return status;
+}
+
+/**
+ * Read a QOI file with decodeQOI.
+ *
+ * @param  file: A pointer to the file being read
+ * @param  header: Pointer to the destination QOI header
+ * @param  image: Pointer to the destination image, freed with freeImage
+ * @return 0 on success, -1 if the file could not be read or decoded
+ */
+int readQOI(FILE* file, struct QOI_Header* header, struct Image* image) {
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0 || st.st_size <= 0) return -1;
+
+    size_t length = (size_t)st.st_size;
+    unsigned char* data = (unsigned char*)malloc(length);
+    if (!data) return -1;
+
+    fseek(file, 0, SEEK_SET);
+    int status = fread(data, 1, length, file) == length ? decodeQOI(data, length, header, image) : -1;
+    free(data);
+    return status;
+}
+
+/**
+ * Write an image as a QOI file with encodeQOI.
+ *
+ * @param  file: A pointer to the file being written
+ * @param  image: Image to write, in any layout
+ * @param  pool: Workers to encode with
+ * @return 0 on success, -1 if the file could not be encoded or written
+ */
+int writeQOI(FILE* file, const struct Image* image, struct ThreadPool* pool) {
+    void* data;
+    size_t length;
+
+    if (encodeQOI(image, pool, &data, &length) != 0) return -1;
+
+    int status = fwrite(data, 1, length, file) == length ? 0 : -1;
+    free(data);
+    return status;
+}
@@ -0,0 +1,127 @@
+/**
+* Loading and saving of QOI ("Quite OK Image") files. Images are encoded by
+* several pool workers at once, each one encoding a band of rows that is then
+* appended to the bands before it.
+*
+* @author Borys Banaszkiewicz
+* @version 1.0
+*/
+
+#ifndef QoiProcessor_H
+#define QoiProcessor_H 1
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "Image.h"
+#include "ThreadPool.h"
+
+#define QOI_HEADER_SIZE 14
+#define QOI_END_MARKER_SIZE 8
+
+struct QOI_Header {
+	char magic[4];			//ID field, always "qoif"
+	unsigned int width;		//width of the image in pixels
+	unsigned int height;		//height of the image in pixels
+	unsigned char channels;		//3 for RGB, 4 for RGBA
+	unsigned char colorspace;	//0 for sRGB with linear alpha, 1 for all channels linear
+};
+
+/**
+ * make QOI header based on width and height. Images are always saved as
+ * 3 channel sRGB since filters never produce an alpha channel.
+ *
+ * @param  header: Pointer to the destination QOI header
+ * @param  width: Width of the image that this header is for
+ * @param  height: Height of the image that this header is for
+ */
+void makeQOIHeader(struct QOI_Header* header, int width, int height);
+
+
+/**
+ * check that a QOI header describes an image this library can decode.
+ *
+ * @param  header: QOI header of the file
+ * @return true if the file is supported
+ */
+bool isSupportedQOI(const struct QOI_Header* header);
+
+
+/**
+ * check whether a block of memory starts with the QOI magic "qoif".
+ *
+ * @param  data: Contents of the file
+ * @param  length: Length of the file in bytes
+ * @return true if the data looks like a QOI file
+ */
+bool isQOIData(const void* data, size_t length);
+
+
+/**
+ * check whether a file starts with the QOI magic "qoif". The file position
+ * is moved back to the start of the file.
+ *
+ * @param  file: A pointer to the file being checked
+ * @return true if the file looks like a QOI file
+ */
+bool isQOIFile(FILE* file);
+
+
+/**
+ * check whether a path names a QOI file, going by its ".qoi" extension.
+ *
+ * @param  path: Path of the file
+ * @return true if the path ends in ".qoi"
+ */
+bool isQOIPath(const char* path);
+
+
+/**
+ * decode a QOI file that was read into memory as a whole. The image is
+ * allocated as IMAGE_BGRX32 and any alpha channel is dropped.
+ *
+ * @param  data: Contents of the file
+ * @param  length: Length of the file in bytes
+ * @param  header: Pointer to the destination QOI header
+ * @param  image: Pointer to the destination image, freed with freeImage
+ * @return 0 on success, -1 if the data is not a complete supported image
+ */
+int decodeQOI(const void* data, size_t length, struct QOI_Header* header, struct Image* image);
+
+
+/**
+ * encode an image as a QOI file in memory. The rows are split into one band
+ * per worker and every band starts with a full color, uses only the index
+ * entries of its own pixels and ends any run on its last pixel, so the bands
+ * can be encoded independently and concatenated into one valid stream.
+ *
+ * @param  image: Image to encode, in any layout
+ * @param  pool: Workers to encode with, one band each
+ * @param  data: Pointer to the destination buffer, released with free
+ * @param  length: Pointer to the length of the encoded file in bytes
+ * @return 0 on success, -1 if the buffers could not be allocated
+ */
+int encodeQOI(const struct Image* image, struct ThreadPool* pool, void** data, size_t* length);
+
+
+/**
+ * read a QOI file with decodeQOI.
+ *
+ * @param  file: A pointer to the file being read
+ * @param  header: Pointer to the destination QOI header
+ * @param  image: Pointer to the destination image, freed with freeImage
+ * @return 0 on success, -1 if the file could not be read or decoded
+ */
+int readQOI(FILE* file, struct QOI_Header* header, struct Image* image);
+
+
+/**
+ * write an image as a QOI file with encodeQOI.
+ *
+ * @param  file: A pointer to the file being written
+ * @param  image: Image to write, in any layout
+ * @param  pool: Workers to encode with
+ * @return 0 on success, -1 if the file could not be encoded or written
+ */
+int writeQOI(FILE* file, const struct Image* image, struct ThreadPool* pool);
+#endif
@@ -0,0 +1,560 @@
+/**
+* Implementation of the persistent worker thread pool.
+*
+* @author Borys Banaszkiewicz
+* @version 1.0
+*/
+
+#define _GNU_SOURCE
+#include "ThreadPool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define THREAD_POOL_QUEUE 64
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define NODE_ROOT "/sys/devices/system/node"
+#define THREAD_POOL_NODES 64
+
+/**
+ * Read the CPU quota of one cgroup directory.
+ *
+ * @param  dir: Directory of the cgroup
+ * @param  v2: true for a cgroup v2 directory, false for a v1 cpu controller directory
+ * @return quota in CPUs rounded up, or 0 if the cgroup has no quota
+ */
+static int readCPUQuota(const char* dir, bool v2) {
+    char path[PATH_MAX + 32];
+    char quota_text[32];
+    long quota = 0, period = 0;
+    FILE* file;
+
+    if (v2) {
+        // "max 100000" without a quota, "200000 100000" for 2 CPUs
+        snprintf(path, sizeof(path), "%s/cpu.max", dir);
+        if (!(file = fopen(path, "r"))) return 0;
+        if (fscanf(file, "%31s %ld", quota_text, &period) == 2 && strcmp(quota_text, "max") != 0) {
+            quota = atol(quota_text);
+        }
+        fclose(file);
+    }
+    else {
+        // a quota of -1 means there is none
+        snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+        if (!(file = fopen(path, "r"))) return 0;
+        if (fscanf(file, "%ld", &quota) != 1) quota = 0;
+        fclose(file);
+
+        snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+        if (!(file = fopen(path, "r"))) return 0;
+        if (fscanf(file, "%ld", &period) != 1) period = 0;
+        fclose(file);
+    }
+
+    if (quota <= 0 || period <= 0) return 0;
+    return (int)((quota + period - 1) / period);
+}
+
+/**
+ * Find the lowest CPU quota of the cgroup of this process and of every cgroup
+ * above it, since the quota of a parent limits all of its children.
+ *
+ * @return quota in CPUs rounded up, or 0 if there is none
+ */
+static int cgroupCPULimit(void) {
+    FILE* file = fopen("/proc/self/cgroup", "r");
+    char line[PATH_MAX];
+    int limit = 0;
+
+    if (!file) return 0;
+
+    // lines are "id:controllers:path", cgroup v2 has no controllers and v1 lists "cpu" among them
+    while (fgets(line, sizeof(line), file)) {
+        char* controllers = strchr(line, ':');
+        char* path = controllers ? strchr(controllers + 1, ':') : NULL;
+        if (!path) continue;
+        *path++ = '\0';
+        controllers++;
+        path[strcspn(path, "\n")] = '\0';
+
+        bool v2 = controllers[0] == '\0';
+        bool v1 = false;
+        for (char* name = strtok(controllers, ","); name; name = strtok(NULL, ",")) {
+            if (strcmp(name, "cpu") == 0) v1 = true;
+        }
+        if (!v1 && !v2) continue;
+
+        for (;;) {
+            char dir[PATH_MAX];
+            snprintf(dir, sizeof(dir), "%s%s%s", CGROUP_ROOT, v2 ? "" : "/cpu", path);
+
+            int quota = readCPUQuota(dir, v2);
+            if (quota > 0 && (limit == 0 || quota < limit)) limit = quota;
+
+            char* parent = strrchr(path, '/');
+            if (!parent || parent[1] == '\0') break;
+            parent[parent == path ? 1 : 0] = '\0';
+        }
+    }
+
+    fclose(file);
+    return limit;
+}
+
+/**
+ * Count the CPUs this process may run on, within its affinity mask and the
+ * CPU quota of its cgroup.
+ *
+ * @return number of CPUs, at least 1
+ */
+int countCPUs(void) {
+    cpu_set_t set;
+    int cpus = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int limit = cgroupCPULimit();
+
+    if (limit > 0 && limit < cpus) cpus = limit;
+    return cpus > 0 ? cpus : 1;
+}
+
+/**
+ * Add a task to the back of a queue, growing its ring buffer when it is full.
+ *
+ * @param  queue: The queue
+ * @param  function: Work to run
+ * @param  arg: Argument passed to the function
+ * @return 0 on success, -1 if the queue could not grow
+ */
+static int pushQueue(struct ThreadPoolQueue* queue, void (*function)(void* arg, int worker), void* arg) {
+    if (queue->queued == queue->capacity) {
+        // unwrap the ring into a buffer twice the size so the queued tasks stay in order
+        int capacity = queue->capacity > 0 ? queue->capacity * 2 : THREAD_POOL_QUEUE;
+        struct ThreadPoolTask* tasks = (struct ThreadPoolTask*)malloc(sizeof(struct ThreadPoolTask) * capacity);
+        if (!tasks) return -1;
+        for (int i = 0; i < queue->queued; i++) {
+            tasks[i] = queue->tasks[(queue->head + i) % queue->capacity];
+        }
+        free(queue->tasks);
+        queue->tasks = tasks;
+        queue->capacity = capacity;
+        queue->head = 0;
+    }
+
+    queue->tasks[(queue->head + queue->queued) % queue->capacity].function = function;
+    queue->tasks[(queue->head + queue->queued) % queue->capacity].arg = arg;
+    queue->queued++;
+    return 0;
+}
+
+/**
+ * Take the task at the front of a queue.
+ *
+ * @param  queue: The queue, must not be empty
+ * @return the task
+ */
+static struct ThreadPoolTask popQueue(struct ThreadPoolQueue* queue) {
+    struct ThreadPoolTask task = queue->tasks[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->queued--;
+    return task;
+}
+
+/**
+ * Take tasks from the queues until the pool is closed and the queues are
+ * empty. Tasks meant for this worker go before the shared ones.
+ *
+ * @param  arg: The ThreadPoolWorker running this loop
+ * @return NULL
+ */
+static void* runWorker(void* arg) {
+    struct ThreadPoolWorker* worker = (struct ThreadPoolWorker*)arg;
+    struct ThreadPool* pool = worker->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (worker->queue.queued == 0 && pool->queue.queued == 0 && !pool->stop) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (worker->queue.queued == 0 && pool->queue.queued == 0) break;
+
+        struct ThreadPoolTask task = popQueue(worker->queue.queued > 0 ? &worker->queue : &pool->queue);
+
+        pthread_mutex_unlock(&pool->lock);
+        task.function(task.arg, worker->index);
+        pthread_mutex_lock(&pool->lock);
+
+        if (--pool->pending == 0) {
+            pthread_cond_broadcast(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/**
+ * Start the worker threads of a pool.
+ *
+ * @param  pool: Pointer to the destination pool
+ * @param  threads: Number of worker threads, at least 1
+ * @return 0 on success, -1 if the pool could not be created
+ */
+int initThreadPool(struct ThreadPool* pool, int threads) {
+    memset(pool, 0, sizeof(struct ThreadPool));
+    if (threads < 1) threads = 1;
+
+    pool->queue.capacity = THREAD_POOL_QUEUE;
+    pool->queue.tasks = (struct ThreadPoolTask*)malloc(sizeof(struct ThreadPoolTask) * pool->queue.capacity);
+    pool->workers = (struct ThreadPoolWorker*)calloc(threads, sizeof(struct ThreadPoolWorker));
+    if (!pool->queue.tasks || !pool->workers) {
+        free(pool->queue.tasks);
+        free(pool->workers);
+        return -1;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (int i = 0; i < threads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (pthread_create(&pool->workers[i].thread, NULL, runWorker, &pool->workers[i]) != 0) break;
+        pool->count++;
+    }
+
+    if (pool->count == 0) {
+        closeThreadPool(pool);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Queue a task for the next free worker.
+ *
+ * @param  pool: The pool
+ * @param  function: Work to run, gets arg and the index of the worker running it
+ * @param  arg: Argument passed to the function
+ * @return 0 on success, -1 if the queue could not grow
+ */
+int submitThreadPool(struct ThreadPool* pool, void (*function)(void* arg, int worker), void* arg) {
+    pthread_mutex_lock(&pool->lock);
+
+    if (pushQueue(&pool->queue, function, arg) != 0) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    pool->pending++;
+
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/**
+ * Queue a task for one particular worker.
+ *
+ * @param  pool: The pool
+ * @param  worker: Index of the worker that has to run the task
+ * @param  function: Work to run, gets arg and the index of the worker running it
+ * @param  arg: Argument passed to the function
+ * @return 0 on success, -1 if the queue could not grow
+ */
+int submitWorkerThreadPool(struct ThreadPool* pool, int worker, void (*function)(void* arg, int worker), void* arg) {
+    pthread_mutex_lock(&pool->lock);
+
+    if (pushQueue(&pool->workers[worker].queue, function, arg) != 0) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    pool->pending++;
+
+    // a signal could wake a different worker, which would go back to sleep and leave the task waiting
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/**
+ * Wait until every task submitted so far has finished.
+ *
+ * @param  pool: The pool
+ */
+void waitThreadPool(struct ThreadPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+struct deque_set {
+    struct ThreadPoolDeque* deques;
+    int count;
+    void (*function)(void* arg, int worker);
+    unsigned char* items;
+    size_t size;
+};
+
+struct deque_owner {
+    struct deque_set* set;
+    int index;
+};
+
+/**
+ * Take the next item of a deque, from the front for its owner or from the
+ * back for a thief.
+ *
+ * @param  deque: The deque
+ * @param  front: true to take the first item, false to take the last one
+ * @return index of the item, or -1 if the deque is empty
+ */
+static int takeDeque(struct ThreadPoolDeque* deque, bool front) {
+    int item = -1;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        item = front ? deque->head++ : --deque->tail;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return item;
+}
+
+/**
+ * Run the items of one deque, then steal from the others until every deque
+ * is empty.
+ *
+ * @param  arg: The deque_owner of the deque
+ * @param  worker: Index of the worker running this task
+ */
+static void drainDeque(void* arg, int worker) {
+    struct deque_owner* owner = (struct deque_owner*)arg;
+    struct deque_set* set = owner->set;
+
+    for (;;) {
+        int item = takeDeque(&set->deques[owner->index], true);
+
+        // the fullest victim has the most work left, so one steal is least likely to be followed by another.
+        // it may have been emptied by the time it is locked again, then the next fullest one is tried
+        for (int attempt = 0; item < 0 && attempt < set->count; attempt++) {
+            int victim = -1, most = 0;
+            for (int i = 0; i < set->count; i++) {
+                pthread_mutex_lock(&set->deques[i].lock);
+                int left = set->deques[i].tail - set->deques[i].head;
+                pthread_mutex_unlock(&set->deques[i].lock);
+                if (i != owner->index && left > most) {
+                    victim = i;
+                    most = left;
+                }
+            }
+            if (victim < 0) break;
+            item = takeDeque(&set->deques[victim], false);
+        }
+        if (item < 0) return;
+
+        set->function(set->items + set->size * item, worker);
+    }
+}
+
+/**
+ * Run a function on every item of an array, spread over one deque per
+ * worker with idle workers stealing from the others.
+ *
+ * @param  pool: The pool
+ * @param  function: Work to run, gets a pointer to an item and the index of the worker running it
+ * @param  items: Array of items
+ * @param  size: Size of one item in bytes
+ * @param  count: Number of items
+ * @return 0 on success, -1 if the deques could not be created and nothing was run
+ */
+int distributeThreadPool(struct ThreadPool* pool, void (*function)(void* arg, int worker), void* items, size_t size, int count) {
+    struct deque_set set = {NULL, pool->count, function, (unsigned char*)items, size};
+    struct deque_owner* owners = (struct deque_owner*)malloc(sizeof(struct deque_owner) * set.count);
+    set.deques = (struct ThreadPoolDeque*)malloc(sizeof(struct ThreadPoolDeque) * set.count);
+    if (!owners || !set.deques) {
+        free(owners);
+        free(set.deques);
+        return -1;
+    }
+
+    // contiguous blocks keep neighbouring items on the same worker as long as nothing is stolen
+    for (int i = 0; i < set.count; i++) {
+        pthread_mutex_init(&set.deques[i].lock, NULL);
+        set.deques[i].head = (int)((long long)count * i / set.count);
+        set.deques[i].tail = (int)((long long)count * (i + 1) / set.count);
+        owners[i].set = &set;
+        owners[i].index = i;
+    }
+    for (int i = 0; i < set.count; i++) {
+        if (submitThreadPool(pool, drainDeque, &owners[i]) != 0) {
+            drainDeque(&owners[i], pool->count);
+        }
+    }
+    waitThreadPool(pool);
+
+    for (int i = 0; i < set.count; i++) {
+        pthread_mutex_destroy(&set.deques[i].lock);
+    }
+    free(owners);
+    free(set.deques);
+    return 0;
+}
+
+/**
+ * Pin every worker to one CPU of the affinity mask of the process.
+ *
+ * @param  pool: The pool
+ * @return 0 on success, -1 if a worker could not be pinned
+ */
+int pinThreadPool(struct ThreadPool* pool) {
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int count = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return -1;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) cpus[count++] = cpu;
+    }
+    if (count == 0) return -1;
+
+    int result = 0;
+    for (int i = 0; i < pool->count; i++) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[i % count], &set);
+        if (pthread_setaffinity_np(pool->workers[i].thread, sizeof(set), &set) != 0) result = -1;
+    }
+    return result;
+}
+
+/**
+ * Read the CPUs of a NUMA node from its cpulist, such as "0-3,8-11".
+ *
+ * @param  node: Number of the node
+ * @param  set: Pointer to the destination CPU set
+ * @return 0 on success, -1 if there is no such node
+ */
+static int readNodeCPUs(int node, cpu_set_t* set) {
+    char path[64];
+    int first, last, next;
+
+    snprintf(path, sizeof(path), NODE_ROOT "/node%d/cpulist", node);
+    FILE* file = fopen(path, "r");
+    if (!file) return -1;
+
+    CPU_ZERO(set);
+    while (fscanf(file, "%d", &first) == 1) {
+        last = first;
+        next = fgetc(file);
+        if (next == '-') {
+            if (fscanf(file, "%d", &last) != 1) break;
+            next = fgetc(file);
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (next != ',') break;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+/**
+ * Find the n-th CPU of a set.
+ *
+ * @param  set: The CPU set, must not be empty
+ * @param  n: Position of the CPU, taken modulo the size of the set
+ * @return number of the CPU
+ */
+static int nthCPU(const cpu_set_t* set, int n) {
+    n %= CPU_COUNT(set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, set) && n-- == 0) return cpu;
+    }
+    return 0;
+}
+
+/**
+ * Bind the workers to NUMA nodes, in contiguous blocks sized by the number
+ * of CPUs every node has in the affinity mask.
+ *
+ * @param  pool: The pool
+ * @param  pin: true to pin every worker to one CPU of its node instead of letting it use the whole node
+ * @return 0 on success, -1 if a worker could not be bound
+ */
+int bindNodesThreadPool(struct ThreadPool* pool, bool pin) {
+    cpu_set_t allowed;
+    cpu_set_t nodes[THREAD_POOL_NODES];
+    int ids[THREAD_POOL_NODES];
+    int count = 0, total = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return -1;
+
+    // node numbers can have gaps, nodes without an allowed CPU get no workers
+    for (int node = 0; node < THREAD_POOL_NODES; node++) {
+        if (readNodeCPUs(node, &nodes[count]) != 0) continue;
+        CPU_AND(&nodes[count], &nodes[count], &allowed);
+        if (CPU_COUNT(&nodes[count]) == 0) continue;
+        ids[count] = node;
+        total += CPU_COUNT(&nodes[count]);
+        count++;
+    }
+    if (count == 0) {
+        nodes[0] = allowed;
+        ids[0] = 0;
+        total = CPU_COUNT(&allowed);
+        count = 1;
+    }
+
+    int result = 0;
+    int node = 0, before = 0, first = 0;
+    for (int i = 0; i < pool->count; i++) {
+        // spread the workers over the CPUs as if they were one list ordered by node
+        long long position = (long long)i * total / pool->count;
+        while (node < count - 1 && position >= before + CPU_COUNT(&nodes[node])) {
+            before += CPU_COUNT(&nodes[node]);
+            node++;
+            first = i;
+        }
+
+        cpu_set_t set = nodes[node];
+        if (pin) {
+            CPU_ZERO(&set);
+            CPU_SET(nthCPU(&nodes[node], i - first), &set);
+        }
+        pool->workers[i].node = ids[node];
+        if (pthread_setaffinity_np(pool->workers[i].thread, sizeof(set), &set) != 0) result = -1;
+    }
+    return result;
+}
+
+/**
+ * Finish the queued tasks and stop the worker threads.
+ *
+ * @param  pool: The pool to close
+ */
+void closeThreadPool(struct ThreadPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    for (int i = 0; i < pool->count; i++) {
+        free(pool->workers[i].queue.tasks);
+    }
+    free(pool->queue.tasks);
+    free(pool->workers);
+    pool->queue.tasks = NULL;
+    pool->workers = NULL;
+    pool->count = 0;
+}
@@ -0,0 +1,154 @@
+/**
+* A fixed set of worker threads that stay alive for the whole run and take
+* tasks from a shared queue, so filtering an image never has to create or
+* join threads.
+*
+* @author Borys Banaszkiewicz
+* @version 1.0
+*/
+
+#ifndef ThreadPool_H
+#define ThreadPool_H 1
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct ThreadPoolTask {
+	void (*function)(void* arg, int worker);	//work to run, gets the index of the worker running it or count for the calling thread
+	void* arg;					//argument passed to the function
+};
+
+struct ThreadPoolQueue {
+	struct ThreadPoolTask* tasks;	//ring buffer of queued tasks
+	int capacity;			//size of the ring buffer, grows when it is full
+	int head;			//next task to run
+	int queued;			//tasks in the ring buffer
+};
+
+struct ThreadPoolWorker {
+	struct ThreadPool* pool;	//pool the worker takes its tasks from
+	int index;			//0 to count - 1
+	int node;			//NUMA node the worker is bound to, 0 until bindNodesThreadPool
+	struct ThreadPoolQueue queue;	//tasks only this worker may run, taken before the shared ones
+	pthread_t thread;
+};
+
+struct ThreadPool {
+	int count;			//number of worker threads
+	struct ThreadPoolWorker* workers;
+	struct ThreadPoolQueue queue;	//tasks any worker may run
+	int pending;			//tasks submitted and not finished yet
+	bool stop;			//set when the pool is closed
+	pthread_mutex_t lock;
+	pthread_cond_t work;		//signalled when a task is queued or the pool is closed
+	pthread_cond_t done;		//signalled when the last pending task finishes
+};
+
+struct ThreadPoolDeque {
+	pthread_mutex_t lock;
+	int head;			//next item the owner runs, taken from the front
+	int tail;			//one past the last item, thieves take from the back
+};
+
+/**
+ * count the CPUs this process may run on. This is the size of its affinity
+ * mask, lowered to the CPU quota of its cgroup (cpu.max, or cpu.cfs_quota_us
+ * with cgroup v1) rounded up, when one is set.
+ *
+ * @return number of CPUs, at least 1
+ */
+int countCPUs(void);
+
+
+/**
+ * start the worker threads of a pool.
+ *
+ * @param  pool: Pointer to the destination pool
+ * @param  threads: Number of worker threads, at least 1
+ * @return 0 on success, -1 if the pool could not be created
+ */
+int initThreadPool(struct ThreadPool* pool, int threads);
+
+
+/**
+ * queue a task for the next free worker.
+ *
+ * @param  pool: The pool
+ * @param  function: Work to run, gets arg and the index of the worker running it
+ * @param  arg: Argument passed to the function, must stay valid until the task finishes
+ * @return 0 on success, -1 if the queue could not grow
+ */
+int submitThreadPool(struct ThreadPool* pool, void (*function)(void* arg, int worker), void* arg);
+
+
+/**
+ * queue a task for one particular worker, for work whose memory should stay
+ * close to the CPU that worker runs on.
+ *
+ * @param  pool: The pool
+ * @param  worker: Index of the worker that has to run the task
+ * @param  function: Work to run, gets arg and the index of the worker running it
+ * @param  arg: Argument passed to the function, must stay valid until the task finishes
+ * @return 0 on success, -1 if the queue could not grow
+ */
+int submitWorkerThreadPool(struct ThreadPool* pool, int worker, void (*function)(void* arg, int worker), void* arg);
+
+
+/**
+ * wait until every task submitted so far has finished. Tasks must not wait on
+ * their own pool.
+ *
+ * @param  pool: The pool
+ */
+void waitThreadPool(struct ThreadPool* pool);
+
+
+/**
+ * run a function on every item of an array and wait until all of them are
+ * done. The items are dealt out in contiguous blocks to one deque per worker.
+ * Every worker runs the items of its own deque in order and, once it is
+ * empty, steals items from the back of the fullest other deque, so a few
+ * expensive items no longer hold up the whole pool.
+ *
+ * @param  pool: The pool
+ * @param  function: Work to run, gets a pointer to an item and the index of the worker running it, or count
+ *         when the calling thread has to run items itself because a task could not be queued
+ * @param  items: Array of items
+ * @param  size: Size of one item in bytes
+ * @param  count: Number of items
+ * @return 0 on success, -1 if the deques could not be created and nothing was run
+ */
+int distributeThreadPool(struct ThreadPool* pool, void (*function)(void* arg, int worker), void* items, size_t size, int count);
+
+
+/**
+ * pin every worker to one CPU of the affinity mask of the process, in order
+ * and starting over when there are more workers than CPUs.
+ *
+ * @param  pool: The pool
+ * @return 0 on success, -1 if a worker could not be pinned
+ */
+int pinThreadPool(struct ThreadPool* pool);
+
+
+/**
+ * bind the workers to NUMA nodes, in contiguous blocks so that neighbouring
+ * workers share a node, with each node getting a share of the workers that
+ * matches its share of the CPUs in the affinity mask. The nodes are read from
+ * /sys/devices/system/node; without it all CPUs count as node 0.
+ *
+ * @param  pool: The pool
+ * @param  pin: true to pin every worker to one CPU of its node instead of letting it use the whole node
+ * @return 0 on success, -1 if a worker could not be bound
+ */
+int bindNodesThreadPool(struct ThreadPool* pool, bool pin);
+
+
+/**
+ * finish the queued tasks and stop the worker threads.
+ *
+ * @param  pool: The pool to close
+ */
+void closeThreadPool(struct ThreadPool* pool);
+#endif